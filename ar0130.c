@@ -1,9 +1,18 @@
+#include <linux/debugfs.h>
+#include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/firmware.h>
+#include <linux/gcd.h>
 #include <linux/i2c.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/log2.h>
+#include <linux/module.h>
 #include <linux/pm.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 #include <media/v4l2-subdev.h>
 #include <linux/videodev2.h>
 
@@ -34,6 +43,10 @@
 
 #define AR0130_PIXEL_ARRAY_WIDTH	1280
 #define AR0130_PIXEL_ARRAY_HEIGHT	960
+#define AR0130_CROP_WIDTH_MIN		16
+#define AR0130_CROP_HEIGHT_MIN		2
+#define AR0130_ROW_OFFSET		2	/* first active row */
+#define AR0130_VBLANK_MIN		30	/* lines, shortest vertical blanking */
 
 #define MAX_WIDTH   		1280
 #define MAX_HEIGHT  		960
@@ -42,11 +55,139 @@
 #define ENABLE			1
 #define DISABLE			0
 
+#define AR0130_I2C_STD_KHZ	100	/* standard-mode camera bus clock */
+#define AR0130_BURST_MAX_WORDS	80	/* largest burst assembled in one message */
+
+/* Stream start stages that stay valid until the sensor is reset */
+#define AR0130_INIT_SEQ		(1 << 0)	/* sequencer and analog setup */
+#define AR0130_INIT_PLL		(1 << 1)
+#define AR0130_INIT_CTRLS	(1 << 2)	/* AE and control values */
+
+/* PLL limits, pixclk = ext_freq / pre_div * mult / (vt_sys_div * vt_pix_div) */
+#define AR0130_EXT_FREQ_MIN	6000000
+#define AR0130_EXT_FREQ_MAX	50000000
+#define AR0130_PFD_FREQ_MIN	2000000		/* ext_freq / pre_div */
+#define AR0130_PFD_FREQ_MAX	24000000
+#define AR0130_VCO_FREQ_MIN	384000000
+#define AR0130_VCO_FREQ_MAX	768000000
+#define AR0130_PIX_CLK_MAX	74250000
+#define AR0130_PLL_PRE_DIV_MAX	64
+#define AR0130_PLL_MULT_MIN	32
+#define AR0130_PLL_MULT_MAX	255
+#define AR0130_PLL_VT_PIX_DIV_MIN	4
+#define AR0130_PLL_VT_PIX_DIV_MAX	16
+
+/* Power-up timing minimums, in EXTCLK cycles */
+#define AR0130_RESET_CYCLES	70	/* RESET_BAR low with EXTCLK running */
+#define AR0130_INIT_CYCLES	160000	/* reset to first i2c access */
+
+#define AR0130_PLL_LOCK_US	1000	/* PLL lock time */
+#define AR0130_ADC_SETTLE_MS	200	/* ADC setup to OPERATION_MODE, no status bit */
+#define AR0130_STREAM_TIMEOUT	100	/* ms, bound of the old fixed PLL delay */
+#define AR0130_STANDBY_TIMEOUT	500	/* ms, longest frame to finish on stop */
+#define AR0130_XCLK_SETTLE_US	100	/* EXTCLK restart before i2c access */
+
 #define AR0130_CHIP_ID 		0x2402
 #define AR0130_RESET_REG 	0x301A
+#define		AR0130_RESET		(1 << 0)
+#define		AR0130_RESTART		(1 << 1)
+#define		AR0130_STREAM		(1 << 2)
+#define		AR0130_GROUPED_HOLD	(1 << 15)
 #define AR0130_STREAM_ON	0x10DC
 #define AR0130_STREAM_OFF	0x10D8
+#define AR0130_DATA_PEDESTAL	0x301E
+#define AR0130_EMBEDDED_DATA_CTRL	0x3064
+#define		AR0130_EMBEDDED_STATS_EN	(1 << 7)
+#define		AR0130_EMBEDDED_DATA		(1 << 8)
+#define		AR0130_EMBEDDED_DATA_DEF	0x1802	/* reserved bits as at reset */
+#define AR0130_FRAME_COUNT	0x303A
+#define AR0130_FRAME_STATUS	0x303C
+#define		AR0130_FRAME_STATUS_STANDBY	(1 << 1)
+#define AR0130_SEQ_CTRL_PORT	0x3088
+#define AR0130_Y_ADDR_START	0x3002
+#define AR0130_X_ADDR_START	0x3004
+#define AR0130_Y_ADDR_END	0x3006
+#define AR0130_X_ADDR_END	0x3008
+#define AR0130_FRAME_LENGTH	0x300A
+#define		AR0130_FRAME_LENGTH_MAX		0xFFFF
+#define AR0130_LINE_LENGTH	0x300C
+#define AR0130_COARSE_INT_TIME	0x3012
+#define AR0130_DIGITAL_BINNING	0x3032
+#define AR0130_X_ODD_INC	0x30A2
+#define AR0130_Y_ODD_INC	0x30A6
+#define		AR0130_EXPOSURE_MIN		1
+#define		AR0130_EXPOSURE_DEF		0x02A0
+#define AR0130_GLOBAL_GAIN	0x305E
+#define		AR0130_GLOBAL_GAIN_MAX		0xFF
+#define		AR0130_GLOBAL_GAIN_DEF		0x20	/* 1.0, xxx.yyyyy */
+#define AR0130_DIGITAL_TEST	0x30B0
+#define		AR0130_COLUMN_GAIN_SHIFT	4	/* 1x, 2x, 4x, 8x */
+#define		AR0130_COLUMN_GAIN_MASK		(3 << 4)
+#define		AR0130_COLUMN_GAIN_MAX		3
+#define AR0130_TEMPSENS_DATA	0x30B2
+#define AR0130_TEMPSENS_CTRL	0x30B4
+#define		AR0130_TEMPSENS_POWER_ON	(1 << 0)
 #define AR0130_SEQ_PORT		0x3086	
+#define AR0130_OPERATION_MODE	0x3082
+#define		AR0130_OP_MODE_LINEAR		(1 << 0)
+#define		AR0130_OP_MODE_RATIO_T1_T2_SHIFT	2	/* 4x << value */
+#define		AR0130_OP_MODE_RATIO_T2_T3_SHIFT	4
+#define		AR0130_OP_MODE_RATIO_16X	2
+#define AR0130_AE_LUMA_TARGET	0x3102
+#define		AR0130_AE_LUMA_TARGET_MAX	0x0FFF	/* 12-bit mean */
+#define AR0130_AE_DCG_EXPOSURE_HIGH	0x3112
+#define AR0130_AE_DCG_EXPOSURE_LOW	0x3114
+#define AR0130_AE_MAX_EXPOSURE	0x311C
+#define AR0130_AE_MIN_EXPOSURE	0x311E
+#define AR0130_AE_ALPHA_V1	0x3126
+#define AR0130_AE_MEAN		0x3152	/* AE_MEAN_L, mean of the AE window */
+#define AR0130_HDR_COMP		0x31D0
+#define		AR0130_HDR_COMP_ENABLE		(1 << 0)	/* to 12 bits */
+
+/*
+ * HDR firmware, big endian 16 bit words: the sequencer length, the
+ * sequencer program as written to SEQ_PORT, then address/value pairs of
+ * the HDR analog setup, written over the linear one.
+ */
+#define AR0130_HDR_FW		"ar0130_hdr.bin"
+#define AR0130_SEQ_MAX_WORDS	256
+#define AR0130_HDR_MAX_REGS	32
+
+#define V4L2_CID_AR0130_HDR		(V4L2_CID_USER_BASE | 0x1001)
+#define V4L2_CID_AR0130_HDR_RATIO	(V4L2_CID_USER_BASE | 0x1002)
+
+#define V4L2_CID_AR0130_EMBEDDED_DATA	(V4L2_CID_USER_BASE | 0x1003)
+#define V4L2_CID_AR0130_DROPPED_FRAMES	(V4L2_CID_USER_BASE | 0x1004)
+#define V4L2_CID_AR0130_AE_ALGORITHM	(V4L2_CID_USER_BASE | 0x1005)
+#define		AR0130_AE_SENSOR		0	/* on-chip AE engine */
+#define		AR0130_AE_SOFTWARE		1	/* ar0130_sw_ae_step() */
+#define V4L2_CID_AR0130_AE_LUMA_TARGET	(V4L2_CID_USER_BASE | 0x1006)
+#define V4L2_CID_AR0130_AE_ALPHA	(V4L2_CID_USER_BASE | 0x1007)
+#define V4L2_CID_AR0130_AE_MAX_EXPOSURE	(V4L2_CID_USER_BASE | 0x1008)
+#define V4L2_CID_AR0130_AE_MIN_EXPOSURE	(V4L2_CID_USER_BASE | 0x1009)
+#define V4L2_CID_AR0130_AE_DCG_HIGH	(V4L2_CID_USER_BASE | 0x100A)
+#define V4L2_CID_AR0130_AE_DCG_LOW	(V4L2_CID_USER_BASE | 0x100B)
+#define V4L2_CID_AR0130_FRAME_RATE_MIN	(V4L2_CID_USER_BASE | 0x100C)
+
+#define AR0130_FRAME_SAMPLE_EVERY	32	/* frames between counter reads */
+
+/* AE tuning defaults */
+#define AR0130_AE_LUMA_TARGET_DEF	0x0384
+#define AR0130_AE_ALPHA_DEF		0x0080
+#define AR0130_AE_MAX_EXPOSURE_DEF	0x03DD
+#define AR0130_AE_MIN_EXPOSURE_DEF	0x0002
+#define AR0130_AE_DCG_HIGH_DEF		0x029F
+#define AR0130_AE_DCG_LOW_DEF		0x008C
+
+/* software AE */
+#define AR0130_AE_TOLERANCE_SHIFT	4	/* settled within 1/16 of target */
+#define AR0130_AE_STABLE_FRAMES		3	/* settled frames to count as converged */
+#define AR0130_AE_LATENCY		2	/* frames before new values show */
+#define AR0130_AE_SIM_UNITY		256	/* simulated luminance of 1.0 */
+
+/* auto frame rate */
+#define AR0130_AFR_EVERY		8	/* frames between frame length steps */
+#define AR0130_AFR_FPS_MIN_DEF		15
 #define AR0130_TEST_REG		0x3070
 #define	AR0130_TEST_PATTERN	0x0000
 /*
@@ -62,18 +203,229 @@ struct ar0130_frame_size {
 	u16 height;
 };
 
-const static struct ar0130_frame_size ar0130_supported_framesizes[] = {
-	{  640,  360 },
-	{  640,  480 },
-	{ 1280,  720 },
-	{ 1280,  960 },
-};
-
 enum resolution {
+AR0130_160x120_SKIP_BINNED,
+AR0130_320x180_SKIP_BINNED,
+AR0130_320x240_SKIP_BINNED,
 AR0130_640x360_BINNED,
 AR0130_640x480_BINNED,
 AR0130_720P_60FPS,
-AR0130_FULL_RES_45FPS
+AR0130_FULL_RES_45FPS,
+AR0130_NUM_MODES
+};
+
+struct ar0130_status {
+	u16 frame_count;
+	u16 frame_status;
+	u16 integration;	/* COARSE_INTEGRATION_TIME, in lines */
+	u16 global_gain;
+	u16 digital_test;	/* holds the column (analog) gain */
+	u16 temperature;	/* raw TEMPSENS_DATA */
+};
+
+/* frame accounting of the current stream */
+struct ar0130_frame_stats {
+	unsigned int produced;	/* frames the sensor output, from FRAME_COUNT */
+	unsigned int delivered;	/* frames reported by ar0130_frame_done() */
+	unsigned int dropped;	/* produced but not delivered, last sample */
+	unsigned int late;	/* intervals over 1.5 frame periods */
+	unsigned int samples;	/* frame counter samples taken */
+	unsigned int intervals;	/* delivery intervals measured */
+	u32 jitter_max_ns;	/* largest deviation from the frame period */
+	u64 jitter_sum_ns;
+	u16 last_count;		/* FRAME_COUNT of the last sample */
+	int synced;		/* last_count is valid */
+	ktime_t last;		/* delivery time of the previous frame */
+};
+
+/* software AE state, owned by ar0130_ae_work() */
+struct ar0130_sw_ae {
+	int enabled;
+	u16 integration;	/* applied COARSE_INTEGRATION_TIME */
+	u16 gain;		/* applied GLOBAL_GAIN */
+	u16 column;		/* applied column gain, 1x << column */
+	unsigned int settle;	/* frames before the last update shows */
+	u32 mean;		/* last AE_MEAN_L, scaled by sim_gain */
+	unsigned int iterations;
+
+	/* convergence measurement against a simulated luminance step */
+	u32 sim_gain;		/* scene luminance, AR0130_AE_SIM_UNITY = as read */
+	int step_pending;
+	unsigned int step_frames;
+	unsigned int stable;
+	ktime_t step_start;
+	unsigned int converge_frames;	/* of the last step */
+	u32 converge_us;
+};
+
+struct ar0130_reg_list {
+	const struct ar0130_reg *regs;
+	unsigned int count;
+};
+
+#define AR0130_REG_LIST(table)	{ table, ARRAY_SIZE(table) }
+#define AR0130_MAX_MODE_REGS	16
+#define AR0130_MAX_READ_RUNS	8	/* address/read pairs per transaction */
+
+/*
+ * Sensor modes, ordered by output size. A mode reads a window of
+ * width * scale by height * scale pixels, scale being bin * skip; the
+ * window itself comes from the crop rectangle.
+ */
+struct ar0130_mode {
+	u16 width;		/* output size */
+	u16 height;
+	u8 bin;			/* 2x2 digital binning */
+	u8 skip;		/* row and column skip factor */
+	u16 line_length;	/* LINE_LENGTH_PCK */
+	struct ar0130_reg_list regs;
+};
+
+/*
+ * All modes keep the 1650 pclk line length; skipping shortens the frame
+ * by rows only, so 160x120 tops out near 166 fps and 320x240 near 88 fps
+ * at 74.25 MHz.
+ */
+#define AR0130_MODE(w, h, b, s, table)					\
+	{ .width = w, .height = h, .bin = b, .skip = s,			\
+	  .line_length = 0x0672, .regs = AR0130_REG_LIST(table) }
+
+static const struct ar0130_mode ar0130_modes[] = {
+	[AR0130_160x120_SKIP_BINNED] =
+		AR0130_MODE(160, 120, 2, 4, ar0130_160x120_skip_binned_regs),
+	[AR0130_320x180_SKIP_BINNED] =
+		AR0130_MODE(320, 180, 2, 2, ar0130_320x180_skip_binned_regs),
+	[AR0130_320x240_SKIP_BINNED] =
+		AR0130_MODE(320, 240, 2, 2, ar0130_320x240_skip_binned_regs),
+	[AR0130_640x360_BINNED]	=
+		AR0130_MODE(640, 360, 2, 1, ar0130_640x360_binned_regs),
+	[AR0130_640x480_BINNED]	=
+		AR0130_MODE(640, 480, 2, 1, ar0130_640x480_binned_regs),
+	[AR0130_720P_60FPS]	=
+		AR0130_MODE(1280, 720, 1, 1, ar0130_720p_60fps_regs),
+	[AR0130_FULL_RES_45FPS]	=
+		AR0130_MODE(1280, 960, 1, 1, ar0130_full_res_45fps_regs),
+};
+
+/*
+ * Bus formats. The sensor always drives DOUT[11:0]; narrower formats are
+ * the most significant bits, picked by the ISP lane shifter. The pedestal
+ * keeps black a whole number of output codes above zero.
+ */
+struct ar0130_format {
+	unsigned int bpp;
+	u16 pedestal;		/* DATA_PEDESTAL, in 12-bit codes */
+	enum v4l2_mbus_pixelcode codes[2][2];	/* [first row odd][first column odd] */
+};
+
+static const struct ar0130_format ar0130_formats[] = {
+	{
+		.bpp		= 12,
+		.pedestal	= 0x00A8,
+		.codes		= {
+			{ V4L2_MBUS_FMT_SGRBG12_1X12, V4L2_MBUS_FMT_SRGGB12_1X12 },
+			{ V4L2_MBUS_FMT_SBGGR12_1X12, V4L2_MBUS_FMT_SGBRG12_1X12 },
+		},
+	}, {
+		.bpp		= 10,
+		.pedestal	= 0x00A8,	/* 42 */
+		.codes		= {
+			{ V4L2_MBUS_FMT_SGRBG10_1X10, V4L2_MBUS_FMT_SRGGB10_1X10 },
+			{ V4L2_MBUS_FMT_SBGGR10_1X10, V4L2_MBUS_FMT_SGBRG10_1X10 },
+		},
+	}, {
+		.bpp		= 8,
+		.pedestal	= 0x0040,	/* 4 */
+		.codes		= {
+			{ V4L2_MBUS_FMT_SGRBG8_1X8, V4L2_MBUS_FMT_SRGGB8_1X8 },
+			{ V4L2_MBUS_FMT_SBGGR8_1X8, V4L2_MBUS_FMT_SGBRG8_1X8 },
+		},
+	},
+};
+
+/* mode timing at the pixel clock of the PLL setup */
+struct ar0130_mode_timing {
+	u32 line_ns;		/* line time */
+	u32 frame_length;	/* shortest frame with the full window, lines */
+	u32 frame_us;		/* that frame time */
+	struct v4l2_fract min_interval;	/* that frame time, exactly */
+	u32 pixel_rate;		/* output pixels per second at that frame time */
+};
+
+/*
+ * Registers mirrored in the per-device shadow cache, sorted by address.
+ * AR0130_REG_AE marks registers the on-chip AE engine updates by itself;
+ * they are treated as volatile while autoexposure is enabled.
+ */
+#define AR0130_REG_AE		(1 << 0)
+
+static const struct ar0130_cache_reg {
+	u16 addr;
+	u16 flags;
+} ar0130_cached_regs[] = {
+	{ 0x3002, 0 },			// Y_ADDR_START
+	{ 0x3004, 0 },			// X_ADDR_START
+	{ 0x3006, 0 },			// Y_ADDR_END
+	{ 0x3008, 0 },			// X_ADDR_END
+	{ 0x300A, 0 },			// FRAME_LENGTH_LINES
+	{ 0x300C, 0 },			// LINE_LENGTH_PCK
+	{ 0x3012, AR0130_REG_AE },	// COARSE_INTEGRATION_TIME
+	{ 0x301A, 0 },			// RESET_REGISTER
+	{ 0x302A, 0 },			// VT_PIX_CLK_DIV
+	{ 0x302C, 0 },			// VT_SYS_CLK_DIV
+	{ 0x302E, 0 },			// PRE_PLL_CLK_DIV
+	{ 0x3030, 0 },			// PLL_MULTIPLIER
+	{ 0x3032, 0 },			// DIGITAL_BINNING
+	{ 0x3044, 0 },			// DARK_CONTROL
+	{ 0x305E, AR0130_REG_AE },	// GLOBAL_GAIN
+	{ 0x3064, 0 },			// EMBEDDED_DATA_CTRL
+	{ 0x306E, 0 },			// DATAPATH_SELECT
+	{ 0x3070, 0 },			// TEST_PATTERN_MODE
+	{ 0x3082, 0 },			// OPERATION_MODE_CTRL
+	{ 0x309E, 0 },			// DCDS_PROG_START_ADDR
+	{ 0x30B0, AR0130_REG_AE },	// DIGITAL_TEST
+	{ 0x30B4, 0 },			// TEMPSENS_CTRL
+	{ 0x30D4, 0 },			// COLUMN_CORRECTION
+	{ 0x30E0, 0 },			// ADC_BITS_2_3
+	{ 0x30E2, 0 },			// ADC_BITS_4_5
+	{ 0x30E4, 0 },			// ADC_BITS_6_7
+	{ 0x30E6, 0 },			// ADC_CONFIG1
+	{ 0x30E8, 0 },			// ADC_CONFIG2
+	{ 0x3100, 0 },			// AE_CTRL_REG
+	{ 0x3102, 0 },			// AE_LUMA_TARGET_REG
+	{ 0x3104, 0 },			// AE_HIST_TARGET_REG
+	{ 0x3112, 0 },			// AE_DCG_EXPOSURE_HIGH_REG
+	{ 0x3114, 0 },			// AE_DCG_EXPOSURE_LOW_REG
+	{ 0x3116, 0 },			// AE_DCG_GAIN_FACTOR_REG
+	{ 0x3118, 0 },			// AE_DCG_GAIN_FACTOR_INV_REG
+	{ 0x311C, 0 },			// AE_MAX_EXPOSURE_REG
+	{ 0x311E, 0 },			// AE_MIN_EXPOSURE_REG
+	{ 0x3126, 0 },			// AE_ALPHA_V1_REG
+	{ 0x31D0, 0 },			// HDR_COMP
+	{ 0x3ED8, 0 },			// DAC_LD_12_13
+	{ 0x3EDA, 0 },			// DAC_LD_14_15
+};
+
+#define AR0130_NUM_CACHED_REGS	ARRAY_SIZE(ar0130_cached_regs)
+
+enum ar0130_power_state {
+	AR0130_POWER_OFF,
+	AR0130_POWER_RESET,	/* RESET_BAR asserted */
+	AR0130_POWER_XCLK,	/* input clock running */
+	AR0130_POWER_RELEASED,	/* RESET_BAR released */
+	AR0130_POWER_ON,	/* soft reset done, registers accessible */
+};
+
+static bool async_power;
+module_param(async_power, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(async_power, "Sequence sensor power-up in the background");
+
+struct ar0130_pll_divs {
+	u16 pre_div;
+	u16 mult;
+	u16 vt_sys_div;
+	u16 vt_pix_div;
+	u32 pix_clk;		/* resulting pixel clock in Hz */
 };
 
 struct ar0130_priv {
@@ -82,18 +434,100 @@ struct ar0130_priv {
 	struct v4l2_rect crop;  /* Sensor window */
 	struct v4l2_rect curr_crop;
 	struct v4l2_mbus_framefmt format;
+	const struct ar0130_format *bus_format;
 	enum resolution res_index;
 	struct v4l2_ctrl_handler ctrls;
+	struct {
+		/* exposure/gain auto cluster */
+		struct v4l2_ctrl *exposure_auto;
+		struct v4l2_ctrl *exposure;
+		struct v4l2_ctrl *again;
+		struct v4l2_ctrl *gain;
+	};
+	struct v4l2_ctrl *embedded;
+	struct v4l2_ctrl *dropped;
+	struct v4l2_ctrl *ae_algorithm;
+	struct v4l2_ctrl *ae_target;
+	struct v4l2_ctrl *ae_alpha;
+	struct {
+		/* AE exposure limits cluster */
+		struct v4l2_ctrl *ae_max_exposure;
+		struct v4l2_ctrl *ae_min_exposure;
+	};
+	struct {
+		/* DCG switch-over cluster */
+		struct v4l2_ctrl *ae_dcg_high;
+		struct v4l2_ctrl *ae_dcg_low;
+	};
+	struct v4l2_ctrl *hdr;
+	struct v4l2_ctrl *hdr_ratio;
+	u16 op_mode;		/* OPERATION_MODE_CTRL of the loaded sequencer */
+	u16 *hdr_seq;		/* HDR firmware, loaded on first use */
+	unsigned int hdr_seq_words;
+	struct ar0130_reg *hdr_regs;
+	unsigned int hdr_nregs;
 	struct ar0130_platform_data *pdata;
-	struct mutex power_lock; /* lock to protect power_count */
-	struct ar0130_pll_divs *pll;
+	/*
+	 * Protects power_count and serializes every sensor access with the
+	 * state behind it. s_ctrl runs with the control handler lock held,
+	 * so the control framework is never called with this one held.
+	 */
+	struct mutex lock;
+	struct ar0130_pll_divs pll;
 	int power_count;
+	enum ar0130_power_state power_state;
+	struct work_struct power_work;
+	struct completion power_done; /* no power-up in flight */
+	int power_error;
 	int autoexposure;
-	u16 xskip;
-	u16 yskip;
+	unsigned int init_done;	/* AR0130_INIT_* stages valid since the last reset */
+	struct ar0130_reg mode_regs[AR0130_MAX_MODE_REGS]; /* mode in the sensor */
+	unsigned int mode_count;	/* 0 if no mode is programmed */
+	struct v4l2_fract interval;	/* requested, 0/0 for the fastest */
+	struct ar0130_mode_timing mode_timing[AR0130_NUM_MODES];
+	unsigned int frame_length;	/* FRAME_LENGTH_LINES for the interval */
+	unsigned int afr_length;	/* stretched by auto frame rate, 0 if not */
+	int xclk_gated;		/* XCLK stopped in standby */
+	int hold_depth;		/* nesting of ar0130_group_hold() */
+	u16 xskip;		/* column skip factor of the active mode */
+	u16 yskip;		/* row skip factor of the active mode */
+
+	/* dropped frame detection, see ar0130_frame_done() */
+	spinlock_t frame_lock;	/* protects frames, taken from any context */
+	struct ar0130_frame_stats frames;
+	struct delayed_work frame_work;	/* FRAME_COUNT sampling while streaming */
+	int streaming;
+
+	struct ar0130_sw_ae ae;
+	struct delayed_work ae_work;	/* software AE and auto frame rate */
+	struct v4l2_ctrl *auto_priority;
+	struct v4l2_ctrl *fps_min;
+	int afr_enabled;	/* AE may lower the frame rate */
+	unsigned int afr_fps_min;
+	unsigned int afr_frames;
+	u16 ae_frame_count;	/* FRAME_COUNT at the last AE work run */
+	int ae_synced;		/* ae_frame_count is valid */
+
+	/* i2c traffic accounting */
+	unsigned int i2c_khz;
+	unsigned int i2c_xfers;
+	unsigned int i2c_bytes;
+	unsigned long i2c_bus_us;
+
+	/* measured readiness waits of the last stream start */
+	unsigned int settle_us;
+	unsigned int pll_lock_us;
+	unsigned int stop_us;
+	unsigned int start_us;
 	
 	/* cache register values */
-	u16 output_control;
+	u16 reg_cache[AR0130_NUM_CACHED_REGS];
+	DECLARE_BITMAP(reg_valid, AR0130_NUM_CACHED_REGS);
+	unsigned int cache_hits;
+	unsigned int cache_misses;
+	unsigned int stream_offs;	/* STREAM_OFF writes sent to the sensor */
+
+	struct dentry *debugfs;
 };
 
 /************************************************************************
@@ -110,396 +544,2417 @@ static struct ar0130_priv *to_ar0130(const struct i2c_client *client)
 }
 
 /**
- * reg_read - reads the data from the given register
- * @client: pointer to i2c client
- * @command: address of the register which is to be read
+ * ar0130_active_frame_length - frame length the sensor runs at
+ * @ar0130: pointer to private data structure
  *
+ * The one of the frame interval, unless auto frame rate stretched it.
  */
-static int ar0130_reg_read(struct i2c_client *client, u16 command)
+static unsigned int ar0130_active_frame_length(struct ar0130_priv *ar0130)
 {
-	struct i2c_msg msg[2];
-	u8 buf[2];
-	int ret;
-
-	/* 16 bit addressable register */
-	command = swab16(command);
-	
-	msg[0].addr  = client->addr;
-	msg[0].flags = 0;
-	msg[0].len   = 2;
-	msg[0].buf   = (u8 *)&command;;
+	return max(ar0130->frame_length, ar0130->afr_length);
+}
 
-	msg[1].addr  = client->addr;
-	msg[1].flags = I2C_M_RD; //1
-	msg[1].len   = 2;
-	msg[1].buf   = buf;
+/**
+ * ar0130_i2c_bus_us - estimate the time a set of messages occupies the bus
+ * @ar0130: pointer to private data structure
+ * @msgs: messages making up one transaction
+ * @num: number of messages
+ *
+ * Every message costs a (repeated) START, the address byte and its payload,
+ * each byte followed by an ACK bit; the transaction ends with a STOP.
+ */
+static unsigned long ar0130_i2c_bus_us(struct ar0130_priv *ar0130,
+				const struct i2c_msg *msgs, int num)
+{
+	unsigned long bits = 1;	/* STOP */
+	int i;
 
-	/*
-	* if return value of this function is < 0,
-	* it mean error.
-	* else, under 16bit is valid data.
-	*/
-	ret = i2c_transfer(client->adapter, msg, 2);
-	
-	if (ret < 0)
-		return ret;
+	for (i = 0; i < num; i++)
+		bits += 1 + (1 + msgs[i].len) * 9;
 
-	memcpy(&ret, buf, 2);
-	return swab16(ret);
-	
-	v4l_err(client, "Read from offset 0x%x error %d", command, ret);
-	return ret;
+	return DIV_ROUND_UP(bits * 1000, ar0130->i2c_khz);
 }
 
 /**
- * reg_write - writes the data into the given register
+ * ar0130_transfer - issue one i2c transaction and account for it
  * @client: pointer to i2c client
- * @command: address of the register in which to write
- * @data: data to be written into the register
+ * @msgs: messages making up the transaction
+ * @num: number of messages
  *
  */
-static int ar0130_reg_write(struct i2c_client *client, u16 command,
-                       u16 data)
+static int ar0130_transfer(struct i2c_client *client, struct i2c_msg *msgs,
+				int num)
 {
-	struct i2c_msg msg;
-	u8 buf[4];
-	int ret;
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	int i;
 
-	/* 16-bit addressable register */
+	/* the serial interface needs EXTCLK, wake the sensor from deep standby */
+	if (ar0130->xclk_gated) {
+		ar0130->pdata->set_xclk(&ar0130->subdev, ar0130->pdata->ext_freq);
+		ar0130->xclk_gated = 0;
+		usleep_range(AR0130_XCLK_SETTLE_US, 2 * AR0130_XCLK_SETTLE_US);
+	}
 
-	command = swab16(command);
-	data = swab16(data);
-	
-	memcpy(buf + 0, &command, 2);
-	memcpy(buf + 2, &data, 2);
-	msg.addr  = client->addr;
-	msg.flags = 0;
-	msg.len   = 4;
-	msg.buf   = buf;
-	
-	/* i2c_transfer return message length, but this function should return 0 if correct case */
-	ret = i2c_transfer(client->adapter, &msg, 1);
-	if (ret >= 0)
-		return 0;
-	else
-		v4l_err(client, "Write failed at 0x%X error %d\n", swab16(command), ret);
-	
-	return ret;
+	ar0130->i2c_xfers++;
+	for (i = 0; i < num; i++)
+		ar0130->i2c_bytes += msgs[i].len;
+	ar0130->i2c_bus_us += ar0130_i2c_bus_us(ar0130, msgs, num);
+
+	return i2c_transfer(client->adapter, msgs, num);
 }
 
 /**
- * ar0130_calc_size - Find the best match for a requested image capture size
- * @width: requested image width in pixels
- * @height: requested image height in pixels
+ * ar0130_cache_index - look up a register in the shadow cache
+ * @command: register address
  *
- * Find the best match for a requested image capture size.  The best match
- * is chosen as the nearest match that has the same number or fewer pixels
- * as the requested size, or the smallest image size if the requested size
- * has fewer pixels than the smallest image.
+ * Returns the cache slot of the register, or -1 if it is not cached.
  */
-static int ar0130_calc_size(unsigned int request_width,
-				unsigned int request_height)
+static int ar0130_cache_index(u16 command)
 {
-	int i = 0;
-	unsigned long requested_pixels = request_width * request_height;
+	int lo = 0, hi = AR0130_NUM_CACHED_REGS - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
 
-	for (i = 0; i < ARRAY_SIZE(ar0130_supported_framesizes); i++) {
-		if (ar0130_supported_framesizes[i].height
-			* ar0130_supported_framesizes[i].width >= requested_pixels)
-		return i;
-	}	
+		if (ar0130_cached_regs[mid].addr == command)
+			return mid;
+		if (ar0130_cached_regs[mid].addr < command)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
 
-	/* couldn't find a match, return the max size as a default */
-	return (ARRAY_SIZE(ar0130_supported_framesizes) - 1);
+	return -1;
 }
 
 /**
- * ar0130_v4l2_try_fmt_cap - Find the best match for a requested image capture size
- * @ar0130_frame_size: a ointer to the structure which specifies requested image size
- * 
- * Find the best match for a requested image capture size.  The best match
- * is chosen as the nearest match that has the same number or fewer pixels
- * as the requested size, or the smallest image size if the requested size
- * has fewer pixels than the smallest image.
+ * ar0130_cache_slot - cache slot usable for a register right now
+ * @ar0130: pointer to private data structure
+ * @command: register address
+ *
+ * Returns -1 for registers that are not cached or are currently volatile.
  */
-static int ar0130_v4l2_try_fmt_cap(struct ar0130_frame_size *requestedsize) 
+static int ar0130_cache_slot(struct ar0130_priv *ar0130, u16 command)
 {
-	int isize;
-		
-	isize = ar0130_calc_size(requestedsize->width,requestedsize->height);
-	
-	requestedsize->width = ar0130_supported_framesizes[isize].width;
-	requestedsize->height = ar0130_supported_framesizes[isize].height;
-	
-	return isize;
+	int idx = ar0130_cache_index(command);
+
+	if (idx >= 0 && (ar0130_cached_regs[idx].flags & AR0130_REG_AE) &&
+		ar0130->autoexposure)
+		return -1;
+
+	return idx;
 }
 
 /**
- * ar0130_reset - Soft resets the sensor
- * @client: pointer to the i2c client
- * 
+ * ar0130_cache_invalidate - forget every cached register value
+ * @ar0130: pointer to private data structure
+ *
+ * Called whenever the sensor returns to its power-on defaults.
  */
-static int ar0130_reset(struct i2c_client *client)
+static void ar0130_cache_invalidate(struct ar0130_priv *ar0130)
 {
-        int ret;
-
-        ret = ar0130_reg_write(client, AR0130_RESET_REG, 0x0001);
-        if (ret < 0)
-                return ret;
-		
-        mdelay(10);
-
-        ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
-        if (ret < 0)
-                return ret;
-
-        return 0;
+	bitmap_zero(ar0130->reg_valid, AR0130_NUM_CACHED_REGS);
 }
 
 /**
- * ar0130_pll_enable - enable the sensor pll
- * @client: pointer to the i2c client
- * 
+ * ar0130_cache_drop_ae - forget the registers owned by the AE engine
+ * @ar0130: pointer to private data structure
+ *
+ * Called when AE is switched on or off, as it may have changed them.
  */
-static int ar0130_pll_enable(struct i2c_client *client)
+static void ar0130_cache_drop_ae(struct ar0130_priv *ar0130)
 {
-	int ret;
-
-	ret = ar0130_reg_write(client, 0x302C, 0x0002);		// VT_SYS_CLK_DIV
-	ret |= ar0130_reg_write(client, 0x302A, 0x0004);	// VT_PIX_CLK_DIV
-	ret |= ar0130_reg_write(client, 0x302E, 0x0002);	// PRE_PLL_CLK_DIV
-	ret |= ar0130_reg_write(client, 0x3030, 0x002C);	// PLL_MULTIPLIER
-	ret |= ar0130_reg_write(client, 0x30B0, 0x1300);	// DIGITAL_TEST
+	int i;
 
-	mdelay(100);
-	
-	return ret;
+	for (i = 0; i < AR0130_NUM_CACHED_REGS; i++)
+		if (ar0130_cached_regs[i].flags & AR0130_REG_AE)
+			__clear_bit(i, ar0130->reg_valid);
 }
 
 /**
- * ar0130_power_on - power on the sensor
+ * ar0130_cache_match - check whether a write would leave a register unchanged
  * @ar0130: pointer to private data structure
- * 
+ * @command: register address
+ * @data: value about to be written
+ *
+ * Counts a cache hit when the write can be skipped.
  */
-static int ar0130_power_on(struct ar0130_priv *ar0130)
+static bool ar0130_cache_match(struct ar0130_priv *ar0130, u16 command,
+				u16 data)
 {
-	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
-
-        /* Ensure RESET_BAR is low */
-        if (ar0130->pdata->reset) {
-                ar0130->pdata->reset(&ar0130->subdev, 1);
-                msleep(1);
-        }
-
-        /* Enable clock */
-        if (ar0130->pdata->set_xclk) {
-                ar0130->pdata->set_xclk(&ar0130->subdev,
-                ar0130->pdata->ext_freq);
-                msleep(1);
-		}
-		
-        /* Now RESET_BAR must be high */
-        if (ar0130->pdata->reset) {
-                ar0130->pdata->reset(&ar0130->subdev, 0);
-                msleep(1);
-        }
+	int idx = ar0130_cache_slot(ar0130, command);
 
-	ar0130_reset(client);
+	if (idx < 0 || !test_bit(idx, ar0130->reg_valid) ||
+		ar0130->reg_cache[idx] != data)
+		return false;
 
-        return 0;
+	ar0130->cache_hits++;
+	return true;
 }
 
 /**
- * ar0130_power_off - power off the sensor
+ * ar0130_cache_update - record a value that is now in a sensor register
  * @ar0130: pointer to private data structure
- * 
+ * @command: register address
+ * @data: register value
+ *
  */
-static int ar0130_power_off(struct ar0130_priv *ar0130)
+static void ar0130_cache_update(struct ar0130_priv *ar0130, u16 command,
+				u16 data)
 {
-	if (ar0130->pdata->set_xclk)
-		ar0130->pdata->set_xclk(&ar0130->subdev, 0);
-	
-	return 0;
-}
+	int idx;
 
-static struct v4l2_mbus_framefmt *
-__ar0130_get_pad_format(struct ar0130_priv *ar0130, struct v4l2_subdev_fh *fh,
-			unsigned int pad, u32 which)
-{
-	switch (which) {
-		case V4L2_SUBDEV_FORMAT_TRY:
-			return v4l2_subdev_get_try_format(fh, pad);
-		case V4L2_SUBDEV_FORMAT_ACTIVE:
-			return &ar0130->format;
-		default:
-			return NULL;
+	/* a soft reset puts every register back to its default */
+	if (command == AR0130_RESET_REG && (data & AR0130_RESET)) {
+		ar0130_cache_invalidate(ar0130);
+		return;
 	}
+
+	idx = ar0130_cache_slot(ar0130, command);
+	if (idx < 0)
+		return;
+
+	ar0130->cache_misses++;
+	/* the restart bit self-clears */
+	if (command == AR0130_RESET_REG)
+		data &= ~AR0130_RESTART;
+	ar0130->reg_cache[idx] = data;
+	__set_bit(idx, ar0130->reg_valid);
 }
 
-static int ar0130_linear_mode_setup(struct i2c_client *client)
+/**
+ * ar0130_read_regs - reads a set of registers in one bus transaction
+ * @client: pointer to i2c client
+ * @regs: registers to read, the values are filled in
+ * @count: number of entries in @regs
+ *
+ * Every run of consecutive addresses becomes an address write followed by a
+ * repeated-start block read, and all runs go out in a single i2c_transfer.
+ */
+static int ar0130_read_regs(struct i2c_client *client, struct ar0130_reg *regs,
+			unsigned int count)
 {
-	int i, ret;
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	struct i2c_msg msg[AR0130_MAX_READ_RUNS * 2];
+	u8 addr[AR0130_MAX_READ_RUNS][2];
+	u8 buf[AR0130_BURST_MAX_WORDS * 2];
+	unsigned int runs = 0, len = 0;
+	unsigned int i, n;
+	int ret;
 
-	ret = ar0130_reg_write(client, 0x3088, 0x8000);		// SEQ_CTRL_PORT
-	for(i = 0; i < 80; i++)
-		ret |= ar0130_reg_write(client, AR0130_SEQ_PORT, ar0130_linear_data[i]);
- 
-	ret |= ar0130_reg_write(client, 0x309E, 0x0000);	// DCDS_PROG_START_ADDR
-	ret |= ar0130_reg_write(client, 0x30E4, 0x6372);	// ADC_BITS_6_7
-	ret |= ar0130_reg_write(client, 0x30E2, 0x7253);	// ADC_BITS_4_5
-	ret |= ar0130_reg_write(client, 0x30E0, 0x5470);	// ADC_BITS_2_3
-	ret |= ar0130_reg_write(client, 0x30E6, 0xC4CC);	// ADC_CONFIG1
-	ret |= ar0130_reg_write(client, 0x30E8, 0x8050);	// ADC_CONFIG2
+	for (i = 0; i < count; i += n) {
+		for (n = 1; i + n < count &&
+			regs[i + n].addr == regs[i].addr + n * 2; n++)
+			;
 
-	mdelay(200);
+		if (runs == AR0130_MAX_READ_RUNS || len + n * 2 > sizeof(buf))
+			return -EINVAL;
 
-	ret |= ar0130_reg_write(client, 0x3082, 0x0029);	// OPERATION_MODE_CTRL
-	ret |= ar0130_reg_write(client, 0x30B0, 0x1300);	// DIGITAL_TEST
-	ret |= ar0130_reg_write(client, 0x30D4, 0xE007);	// COLUMN_CORRECTION
-	ret |= ar0130_reg_write(client, 0x301A, 0x10DC);	// RESET_REGISTER
-	ret |= ar0130_reg_write(client, 0x301A, 0x10D8);	// RESET_REGISTER
-	ret |= ar0130_reg_write(client, 0x3044, 0x0400);	// DARK_CONTROL
-	ret |= ar0130_reg_write(client, 0x3EDA, 0x0F03);	// DAC_LD_14_15
-	ret |= ar0130_reg_write(client, 0x3ED8, 0x01EF);	// DAC_LD_12_13
-	ret |= ar0130_reg_write(client, 0x3012, 0x02A0);	// COARSE_INTEGRATION_TIME
+		addr[runs][0] = regs[i].addr >> 8;
+		addr[runs][1] = regs[i].addr & 0xff;
 
-	return ret;
-}
+		msg[runs * 2].addr	= client->addr;
+		msg[runs * 2].flags	= 0;
+		msg[runs * 2].len	= 2;
+		msg[runs * 2].buf	= addr[runs];
 
-static int ar0130_set_resolution(struct i2c_client *client, enum resolution res_index)
-{
-	int ret;
+		msg[runs * 2 + 1].addr	= client->addr;
+		msg[runs * 2 + 1].flags	= I2C_M_RD;
+		msg[runs * 2 + 1].len	= n * 2;
+		msg[runs * 2 + 1].buf	= buf + len;
 
-	switch(res_index){
-	case AR0130_FULL_RES_45FPS: //1280x960
-		ret = ar0130_reg_write(client, 0x3032, 0x0000);		// DIGITAL_BINNING
-		ret |= ar0130_reg_write(client, 0x3002, 0x0002);	// Y_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3004, 0x0000);	// X_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3006, 0x03C1);	// Y_ADDR_END
-		ret |= ar0130_reg_write(client, 0x3008, 0x04FF);	// X_ADDR_END
-		ret |= ar0130_reg_write(client, 0x300A, 0x03DE);	// FRAME_LENGTH_LINES
-		ret |= ar0130_reg_write(client, 0x300C, 0x0672);	// LINE_LENGTH_PCK
-		break;
-	case AR0130_720P_60FPS: //1280x720 
-		ret = ar0130_reg_write(client, 0x3032, 0x0000);		// DIGITAL_BINNING
-		ret |= ar0130_reg_write(client, 0x3002, 0x0002);	// Y_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3004, 0x0000);	// X_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3006, 0x02D1);	// Y_ADDR_END
-		ret |= ar0130_reg_write(client, 0x3008, 0x04FF);	// X_ADDR_END
-		ret |= ar0130_reg_write(client, 0x300A, 0x02EF);	// FRAME_LENGTH_LINES
-		ret |= ar0130_reg_write(client, 0x300C, 0x0672);	// LINE_LENGTH_PCK
-		break;
-	case AR0130_640x480_BINNED: //(640,480):
-		ret = ar0130_reg_write(client, 0x3032, 0x0002);		// DIGITAL_BINNING
-		ret |= ar0130_reg_write(client, 0x3002, 0x0002);	// Y_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3004, 0x0000);	// X_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3006, 0x03C1);	// Y_ADDR_END
-		ret |= ar0130_reg_write(client, 0x3008, 0x04FF);	// X_ADDR_END
-		ret |= ar0130_reg_write(client, 0x300A, 0x03DE);	// FRAME_LENGTH_LINES
-		ret |= ar0130_reg_write(client, 0x300C, 0x0672);	// LINE_LENGTH_PCK
-		ret |= ar0130_reg_write(client, 0x306E, 0x9010);	// DATAPATH_SELECT
-		break;
-	case AR0130_640x360_BINNED: //(640,360):
-		ret = ar0130_reg_write(client, 0x3032, 0x0002);		// DIGITAL_BINNING
-		ret |= ar0130_reg_write(client, 0x3002, 0x0002);	// Y_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3004, 0x0000);	// X_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3006, 0x02D1);	// Y_ADDR_END
-		ret |= ar0130_reg_write(client, 0x3008, 0x04FF);	// X_ADDR_END
-		ret |= ar0130_reg_write(client, 0x300A, 0x03DE);	// FRAME_LENGTH_LINES
-		ret |= ar0130_reg_write(client, 0x300C, 0x0672);	// LINE_LENGTH_PCK
-		ret |= ar0130_reg_write(client, 0x306E, 0x9010);	// DATAPATH_SELECT
-		break;
-	default: // AR0130_FULL_RES_45FPS
-		ret = ar0130_reg_write(client, 0x3032, 0x0000);		// DIGITAL_BINNING
-		ret |= ar0130_reg_write(client, 0x3002, 0x0002);	// Y_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3004, 0x0000);	// X_ADDR_START
-		ret |= ar0130_reg_write(client, 0x3006, 0x03C1);	// Y_ADDR_END
-		ret |= ar0130_reg_write(client, 0x3008, 0x04FF);	// X_ADDR_END
-		ret |= ar0130_reg_write(client, 0x300A, 0x03DE);	// FRAME_LENGTH_LINES
-		ret |= ar0130_reg_write(client, 0x300C, 0x0672);	// LINE_LENGTH_PCK
-		break;
+		len += n * 2;
+		runs++;
 	}
-	
-	return ret;
-}
-
-static int ar0130_set_autoexposure(struct i2c_client *client, int enable)
-{
-	struct ar0130_priv *ar0130 = to_ar0130(client);
-	int ret;
 
-	if(enable){
-		ar0130->autoexposure = 1;
-		ret = ar0130_reg_write(client, 0x3064, 0x1982);		// EMBEDDED_DATA_CTRL
-		ret |= ar0130_reg_write(client, 0x3100, 0x001B);	// AE_CTRL_REG
-		ret |= ar0130_reg_write(client, 0x3112, 0x029F);	// AE_DCG_EXPOSURE_HIGH_REG
-		ret |= ar0130_reg_write(client, 0x3114, 0x008C);	// AE_DCG_EXPOSURE_LOW_REG
-		ret |= ar0130_reg_write(client, 0x3116, 0x02C0);	// AE_DCG_GAIN_FACTOR_REG
-		ret |= ar0130_reg_write(client, 0x3118, 0x005B);	// AE_DCG_GAIN_FACTOR_INV_REG
-		ret |= ar0130_reg_write(client, 0x3102, 0x0384);	// AE_LUMA_TARGET_REG
-		ret |= ar0130_reg_write(client, 0x3104, 0x1000);	// AE_HIST_TARGET_REG
-		ret |= ar0130_reg_write(client, 0x3126, 0x0080);	// AE_ALPHA_V1_REG
-		ret |= ar0130_reg_write(client, 0x311C, 0x03DD);	// AE_MAX_EXPOSURE_REG
-		ret |= ar0130_reg_write(client, 0x311E, 0x0002);	// AE_MIN_EXPOSURE_REG
+	ret = ar0130_transfer(client, msg, runs * 2);
+	if (ret < 0) {
+		v4l_err(client, "Read from offset 0x%x error %d\n",
+			regs[0].addr, ret);
 		return ret;
 	}
-	else {
-		ar0130->autoexposure = 0;
-		ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
-		ret |= ar0130_reg_write(client, 0x3100, 0x001A);	// AE_CTRL_REG
-		ret |= ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_ON);
-		return ret;
+
+	for (i = 0; i < count; i++) {
+		regs[i].val = (buf[i * 2] << 8) | buf[i * 2 + 1];
+		if (ar0130_cache_slot(ar0130, regs[i].addr) >= 0)
+			ar0130_cache_update(ar0130, regs[i].addr, regs[i].val);
 	}
-}
 
-/************************************************************************
-                        v4l2_subdev_core_ops
-************************************************************************/
-static int ar0130_g_chip_ident(struct v4l2_subdev *sd,
-				struct v4l2_dbg_chip_ident *id)
-{
-	id->ident    = V4L2_IDENT_AR0130;
-	id->revision = 1;
-	
 	return 0;
 }
 
-static int ar0130_g_ctrl(struct v4l2_subdev *sd, struct v4l2_control *ctrl)
+/**
+ * ar0130_burst_read - reads a block of consecutive registers
+ * @client: pointer to i2c client
+ * @command: address of the first register
+ * @data: host-endian register values
+ * @count: number of registers
+ *
+ * Blocks longer than pdata->i2c_max_len are split over several transactions.
+ */
+static int ar0130_burst_read(struct i2c_client *client, u16 command,
+			u16 *data, unsigned int count)
 {
-	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	struct ar0130_reg regs[AR0130_BURST_MAX_WORDS];
+	unsigned int max_words = AR0130_BURST_MAX_WORDS;
+	unsigned int i, n;
+	int ret;
 
-	switch (ctrl->id) {
-		case V4L2_CID_EXPOSURE_AUTO:
-			ctrl->value = ar0130->autoexposure;
-			break;
+	if (ar0130->pdata->i2c_max_len >= 2)
+		max_words = min_t(unsigned int, max_words,
+				ar0130->pdata->i2c_max_len / 2);
+
+	while (count) {
+		n = min(count, max_words);
+		for (i = 0; i < n; i++)
+			regs[i].addr = command + i * 2;
+
+		ret = ar0130_read_regs(client, regs, n);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < n; i++)
+			data[i] = regs[i].val;
+
+		command += n * 2;
+		data += n;
+		count -= n;
 	}
-	
+
 	return 0;
 }
 
-static int ar0130_s_ctrl(struct v4l2_subdev *sd, struct v4l2_control *ctrl)
-{
-	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	int ret = 0;
+/**
+ * reg_read - reads the data from the given register
+ * @client: pointer to i2c client
+ * @command: address of the register which is to be read
+ *
+ * Returns the register value, or a negative error code.
+ */
+static int ar0130_reg_read(struct i2c_client *client, u16 command)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	int idx;
+	u16 data;
+	int ret;
+
+	/* non-volatile registers are served from the shadow cache */
+	idx = ar0130_cache_slot(ar0130, command);
+	if (idx >= 0 && test_bit(idx, ar0130->reg_valid)) {
+		ar0130->cache_hits++;
+		return ar0130->reg_cache[idx];
+	}
+
+	ret = ar0130_burst_read(client, command, &data, 1);
+	if (ret < 0)
+		return ret;
+
+	return data;
+}
+
+/**
+ * reg_write - writes the data into the given register
+ * @client: pointer to i2c client
+ * @command: address of the register in which to write
+ * @data: data to be written into the register
+ *
+ */
+static int ar0130_reg_write(struct i2c_client *client, u16 command,
+                       u16 data)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	u16 reg = command, val = data;
+	struct i2c_msg msg;
+	u8 buf[4];
+	int ret;
+
+	/* skip writes that would not change the register */
+	if (ar0130_cache_match(ar0130, command, data))
+		return 0;
+
+	/* 16-bit addressable register */
+
+	command = swab16(command);
+	data = swab16(data);
+	
+	memcpy(buf + 0, &command, 2);
+	memcpy(buf + 2, &data, 2);
+	msg.addr  = client->addr;
+	msg.flags = 0;
+	msg.len   = 4;
+	msg.buf   = buf;
+	
+	/* i2c_transfer return message length, but this function should return 0 if correct case */
+	ret = ar0130_transfer(client, &msg, 1);
+	if (ret >= 0) {
+		if (reg == AR0130_RESET_REG && !(val & AR0130_STREAM))
+			ar0130->stream_offs++;
+		ar0130_cache_update(ar0130, reg, val);
+		return 0;
+	} else
+		v4l_err(client, "Write failed at 0x%X error %d\n", swab16(command), ret);
+	
+	return ret;
+}
+
+/**
+ * ar0130_burst_write - writes a block of words in as few messages as possible
+ * @client: pointer to i2c client
+ * @command: address of the first register
+ * @data: data words to be written
+ * @count: number of data words
+ * @autoinc: advance the register address after every word
+ *
+ * The sensor auto-increments the register address within a write message,
+ * except for data ports such as AR0130_SEQ_PORT which consume every word
+ * sent to them; pass @autoinc = 0 for those. Messages are split so they
+ * never exceed pdata->i2c_max_len bytes.
+ */
+static int ar0130_burst_write(struct i2c_client *client, u16 command,
+			const u16 *data, unsigned int count, int autoinc)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	struct i2c_msg msg;
+	u8 buf[2 + AR0130_BURST_MAX_WORDS * 2];
+	unsigned int max_words = AR0130_BURST_MAX_WORDS;
+	unsigned int i, n;
+	int ret;
+
+	if (ar0130->pdata->i2c_max_len >= 4)
+		max_words = min_t(unsigned int, max_words,
+				(ar0130->pdata->i2c_max_len - 2) / 2);
+
+	while (count) {
+		n = min(count, max_words);
+
+		buf[0] = command >> 8;
+		buf[1] = command & 0xff;
+		for (i = 0; i < n; i++) {
+			buf[2 + i * 2] = data[i] >> 8;
+			buf[3 + i * 2] = data[i] & 0xff;
+		}
+
+		msg.addr  = client->addr;
+		msg.flags = 0;
+		msg.len   = 2 + n * 2;
+		msg.buf   = buf;
+
+		ret = ar0130_transfer(client, &msg, 1);
+		if (ret < 0) {
+			v4l_err(client, "Burst write failed at 0x%X error %d\n",
+				command, ret);
+			return ret;
+		}
+
+		if (autoinc) {
+			for (i = 0; i < n; i++)
+				ar0130_cache_update(ar0130, command + i * 2, data[i]);
+			command += n * 2;
+		}
+		data += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * ar0130_write_regs - writes a register table
+ * @client: pointer to i2c client
+ * @regs: register/value pairs
+ * @count: number of entries in @regs
+ *
+ * Entries whose value is already in the sensor are dropped; runs of
+ * consecutive register addresses among the rest are merged into one burst
+ * write.
+ */
+static int ar0130_write_regs(struct i2c_client *client,
+			const struct ar0130_reg *regs, unsigned int count)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	u16 vals[AR0130_BURST_MAX_WORDS];
+	unsigned int i, n, next;
+	int ret;
+
+	for (i = 0; i < count; i = next) {
+		next = i + 1;
+		if (ar0130_cache_match(ar0130, regs[i].addr, regs[i].val))
+			continue;
+
+		vals[0] = regs[i].val;
+		for (n = 1; next < count && n < AR0130_BURST_MAX_WORDS &&
+			regs[next].addr == regs[i].addr + n * 2; n++, next++) {
+			if (ar0130_cache_match(ar0130, regs[next].addr,
+						regs[next].val)) {
+				next++;
+				break;
+			}
+			vals[n] = regs[next].val;
+		}
+
+		ret = ar0130_burst_write(client, regs[i].addr, vals, n, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ar0130_write_regs_delta - writes what changes between two register tables
+ * @client: pointer to i2c client
+ * @from: table currently programmed into the sensor
+ * @to: table to program
+ *
+ * Only entries of @to that are missing from @from or hold a different value
+ * are written. Registers present only in @from keep their current value,
+ * so the mode tables all list the same registers.
+ */
+static int ar0130_write_regs_delta(struct i2c_client *client,
+			const struct ar0130_reg_list *from,
+			const struct ar0130_reg_list *to)
+{
+	struct ar0130_reg delta[AR0130_MAX_MODE_REGS];
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < to->count; i++) {
+		for (j = 0; j < from->count; j++)
+			if (from->regs[j].addr == to->regs[i].addr)
+				break;
+
+		if (j < from->count && from->regs[j].val == to->regs[i].val)
+			continue;
+
+		if (WARN_ON(n == ARRAY_SIZE(delta)))
+			return -EINVAL;
+		delta[n++] = to->regs[i];
+	}
+
+	return ar0130_write_regs(client, delta, n);
+}
+
+/**
+ * ar0130_poll_reg - waits for a register field to reach a value
+ * @client: pointer to i2c client
+ * @command: address of the register to poll
+ * @mask: bits of the register to compare
+ * @val: expected value of the masked bits
+ * @timeout_ms: give up after this many milliseconds
+ *
+ * Sleeps between reads. Returns the time waited in microseconds, or a
+ * negative error code.
+ */
+static int ar0130_poll_reg(struct i2c_client *client, u16 command, u16 mask,
+			u16 val, unsigned int timeout_ms)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(timeout_ms);
+	ktime_t start = ktime_get();
+	int data;
+
+	for (;;) {
+		data = ar0130_reg_read(client, command);
+		if (data < 0)
+			return data;
+		if ((data & mask) == val)
+			return ktime_to_us(ktime_sub(ktime_get(), start));
+		if (time_after(jiffies, timeout))
+			break;
+		usleep_range(500, 1000);
+	}
+
+	v4l_err(client, "Timeout waiting for 0x%X & 0x%X == 0x%X (0x%X)\n",
+		command, mask, val, data);
+	return -ETIMEDOUT;
+}
+
+/**
+ * ar0130_read_status - takes a snapshot of the sensor status registers
+ * @client: pointer to i2c client
+ * @status: filled with the current values
+ *
+ * All registers are fetched in one repeated-start transaction.
+ */
+static int ar0130_read_status(struct i2c_client *client,
+			struct ar0130_status *status)
+{
+	struct ar0130_reg regs[] = {
+		{ AR0130_FRAME_COUNT },
+		{ AR0130_FRAME_STATUS },
+		{ AR0130_COARSE_INT_TIME },
+		{ AR0130_GLOBAL_GAIN },
+		{ AR0130_DIGITAL_TEST },
+		{ AR0130_TEMPSENS_DATA },
+	};
+	int ret;
+
+	ret = ar0130_read_regs(client, regs, ARRAY_SIZE(regs));
+	if (ret < 0)
+		return ret;
+
+	status->frame_count	= regs[0].val;
+	status->frame_status	= regs[1].val;
+	status->integration	= regs[2].val;
+	status->global_gain	= regs[3].val;
+	status->digital_test	= regs[4].val;
+	status->temperature	= regs[5].val;
+
+	return 0;
+}
+
+/**
+ * ar0130_sleep_cycles - sleep for a number of EXTCLK cycles
+ * @ar0130: pointer to private data structure
+ * @cycles: number of input clock cycles
+ *
+ */
+static void ar0130_sleep_cycles(struct ar0130_priv *ar0130, unsigned int cycles)
+{
+	unsigned long us;
+
+	us = div_u64((u64)cycles * USEC_PER_SEC + ar0130->pdata->ext_freq - 1,
+			ar0130->pdata->ext_freq);
+	usleep_range(us + 10, 2 * us + 20);
+}
+
+/**
+ * ar0130_reset - Soft resets the sensor
+ * @client: pointer to the i2c client
+ * 
+ */
+static int ar0130_reset(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+        int ret;
+
+	ar0130->init_done = 0;
+	ar0130->mode_count = 0;
+	ar0130->afr_length = 0;
+
+        ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_RESET);
+        if (ret < 0)
+                return ret;
+		
+	ar0130_sleep_cycles(ar0130, AR0130_INIT_CYCLES);
+
+        ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
+        if (ret < 0)
+                return ret;
+
+        return 0;
+}
+
+/* legal VT_SYS_CLK_DIV values */
+static const u8 ar0130_vt_sys_divs[] = { 1, 2, 4, 6, 8, 10, 12, 14, 16 };
+
+/**
+ * ar0130_pll_setup - choose the PLL dividers
+ * @client: pointer to the i2c client
+ * @ar0130: pointer to private data structure
+ *
+ * Searches the legal divider space for the highest pixel clock that does
+ * not exceed pdata->target_freq, the sensor maximum nor
+ * pdata->isp_max_freq. For each divider combination the best multiplier
+ * follows directly, so only the dividers are iterated. Ties keep the
+ * lowest pre-divider, which maximises the PFD frequency and PLL stability.
+ */
+static int ar0130_pll_setup(struct i2c_client *client,
+			struct ar0130_priv *ar0130)
+{
+	u32 ext_freq = ar0130->pdata->ext_freq;
+	u32 target = ar0130->pdata->target_freq;
+	u32 isp_max = ar0130->pdata->isp_max_freq;
+	struct ar0130_pll_divs *pll = &ar0130->pll;
+	unsigned int pre, sys, pix;
+
+	if (ext_freq < AR0130_EXT_FREQ_MIN || ext_freq > AR0130_EXT_FREQ_MAX) {
+		dev_err(&client->dev, "ext_freq %u Hz out of range\n", ext_freq);
+		return -EINVAL;
+	}
+
+	if (!target || target > AR0130_PIX_CLK_MAX)
+		target = AR0130_PIX_CLK_MAX;
+	if (isp_max && target > isp_max)
+		target = isp_max;
+
+	memset(pll, 0, sizeof(*pll));
+
+	for (pre = 1; pre <= AR0130_PLL_PRE_DIV_MAX; pre++) {
+		u32 pfd = ext_freq / pre;
+
+		if (pfd > AR0130_PFD_FREQ_MAX)
+			continue;
+		if (pfd < AR0130_PFD_FREQ_MIN)
+			break;
+
+		for (sys = 0; sys < ARRAY_SIZE(ar0130_vt_sys_divs); sys++) {
+			for (pix = AR0130_PLL_VT_PIX_DIV_MIN;
+			     pix <= AR0130_PLL_VT_PIX_DIV_MAX; pix++) {
+				u32 div = ar0130_vt_sys_divs[sys] * pix;
+				u64 mult, vco, clk;
+
+				/* largest multiplier within target */
+				mult = div_u64((u64)target * pre * div, ext_freq);
+				mult = min_t(u64, mult, AR0130_PLL_MULT_MAX);
+				if (mult < AR0130_PLL_MULT_MIN)
+					continue;
+
+				vco = div_u64((u64)ext_freq * mult, pre);
+				if (vco > AR0130_VCO_FREQ_MAX) {
+					mult = div_u64((u64)AR0130_VCO_FREQ_MAX * pre,
+							ext_freq);
+					vco = div_u64((u64)ext_freq * mult, pre);
+				}
+				if (mult < AR0130_PLL_MULT_MIN ||
+				    vco < AR0130_VCO_FREQ_MIN)
+					continue;
+
+				clk = div_u64(vco, div);
+				if (clk <= pll->pix_clk)
+					continue;
+
+				pll->pre_div = pre;
+				pll->mult = mult;
+				pll->vt_sys_div = ar0130_vt_sys_divs[sys];
+				pll->vt_pix_div = pix;
+				pll->pix_clk = clk;
+			}
+		}
+	}
+
+	if (!pll->pix_clk) {
+		dev_err(&client->dev, "no PLL setup for %u Hz from %u Hz\n",
+			target, ext_freq);
+		return -EINVAL;
+	}
+
+	dev_dbg(&client->dev, "PLL %u / %u * %u / (%u * %u) = %u Hz\n",
+		ext_freq, pll->pre_div, pll->mult, pll->vt_sys_div,
+		pll->vt_pix_div, pll->pix_clk);
+
+	return 0;
+}
+
+/**
+ * ar0130_pll_enable - enable the sensor pll
+ * @client: pointer to the i2c client
+ * 
+ */
+static int ar0130_pll_enable(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	struct ar0130_pll_divs *pll = &ar0130->pll;
+	int ret;
+
+	ret = ar0130_reg_write(client, 0x302C, pll->vt_sys_div);	// VT_SYS_CLK_DIV
+	ret |= ar0130_reg_write(client, 0x302A, pll->vt_pix_div);	// VT_PIX_CLK_DIV
+	ret |= ar0130_reg_write(client, 0x302E, pll->pre_div);		// PRE_PLL_CLK_DIV
+	ret |= ar0130_reg_write(client, 0x3030, pll->mult);		// PLL_MULTIPLIER
+	ret |= ar0130_reg_write(client, 0x30B0, 0x1300);	// DIGITAL_TEST
+
+	/*
+	 * Lock can't be observed in standby; ar0130_wait_streaming() checks
+	 * the sensor actually starts once streaming is enabled.
+	 */
+	usleep_range(AR0130_PLL_LOCK_US, 2 * AR0130_PLL_LOCK_US);
+	
+	return ret;
+}
+
+/**
+ * ar0130_wait_streaming - wait for the sensor to leave standby
+ * @client: pointer to the i2c client
+ *
+ * The sensor only leaves standby once its PLL runs, so this also bounds
+ * the PLL lock time.
+ */
+static int ar0130_wait_streaming(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	int waited;
+
+	waited = ar0130_poll_reg(client, AR0130_FRAME_STATUS,
+				AR0130_FRAME_STATUS_STANDBY, 0,
+				AR0130_STREAM_TIMEOUT);
+	if (waited < 0)
+		return waited;
+
+	ar0130->pll_lock_us = AR0130_PLL_LOCK_US + waited;
+	dev_dbg(&client->dev, "settled after %u us, streaming after %u us\n",
+		ar0130->settle_us, ar0130->pll_lock_us);
+
+	return 0;
+}
+
+/**
+ * ar0130_power_step - advance the power-up sequence by one state
+ * @ar0130: pointer to private data structure
+ *
+ */
+static int ar0130_power_step(struct ar0130_priv *ar0130)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	struct ar0130_platform_data *pdata = ar0130->pdata;
+	int ret;
+
+	switch (ar0130->power_state) {
+	case AR0130_POWER_OFF:
+		/* Ensure RESET_BAR is low */
+		if (pdata->reset)
+			pdata->reset(&ar0130->subdev, 1);
+		ar0130->power_state = AR0130_POWER_RESET;
+		break;
+
+	case AR0130_POWER_RESET:
+		/* Enable clock, reset needs a few cycles of it to take effect */
+		if (pdata->set_xclk)
+			pdata->set_xclk(&ar0130->subdev, pdata->ext_freq);
+		ar0130_sleep_cycles(ar0130, AR0130_RESET_CYCLES);
+		ar0130->power_state = AR0130_POWER_XCLK;
+		break;
+
+	case AR0130_POWER_XCLK:
+		/* Now RESET_BAR must be high */
+		if (pdata->reset) {
+			pdata->reset(&ar0130->subdev, 0);
+			ar0130_sleep_cycles(ar0130, AR0130_INIT_CYCLES);
+		}
+		ar0130->power_state = AR0130_POWER_RELEASED;
+		break;
+
+	case AR0130_POWER_RELEASED:
+		ret = ar0130_reset(client);
+		if (ret < 0)
+			return ret;
+		ar0130->power_state = AR0130_POWER_ON;
+		break;
+
+	case AR0130_POWER_ON:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * ar0130_power_off - power off the sensor
+ * @ar0130: pointer to private data structure
+ * 
+ */
+static int ar0130_power_off(struct ar0130_priv *ar0130)
+{
+	ar0130->power_state = AR0130_POWER_OFF;
+	ar0130->xclk_gated = 0;
+	ar0130_cache_invalidate(ar0130);
+	ar0130->init_done = 0;
+	ar0130->mode_count = 0;
+	ar0130->afr_length = 0;
+
+	if (ar0130->pdata->set_xclk)
+		ar0130->pdata->set_xclk(&ar0130->subdev, 0);
 	
+	return 0;
+}
+
+/**
+ * ar0130_power_on - power on the sensor
+ * @ar0130: pointer to private data structure
+ * 
+ */
+static int ar0130_power_on(struct ar0130_priv *ar0130)
+{
+	int ret = 0;
+
+	while (ar0130->power_state != AR0130_POWER_ON && ret >= 0)
+		ret = ar0130_power_step(ar0130);
+
+	/* the next attempt has to start with RESET_BAR asserted again */
+	if (ret < 0)
+		ar0130_power_off(ar0130);
+
+	return ret;
+}
+
+static void ar0130_power_work(struct work_struct *work)
+{
+	struct ar0130_priv *ar0130 = container_of(work, struct ar0130_priv,
+						power_work);
+
+	ar0130->power_error = ar0130_power_on(ar0130);
+	if (ar0130->power_error)
+		dev_err(ar0130->subdev.v4l2_dev->dev,
+			"Failed to power on: %d\n", ar0130->power_error);
+	complete_all(&ar0130->power_done);
+}
+
+/**
+ * ar0130_power_wait - wait for a background power-up to finish
+ * @ar0130: pointer to private data structure
+ *
+ * Must be called before touching the sensor from any operation that may
+ * run while async_power is sequencing the sensor up.
+ */
+static int ar0130_power_wait(struct ar0130_priv *ar0130)
+{
+	wait_for_completion(&ar0130->power_done);
+	return ar0130->power_error;
+}
+
+/**
+ * ar0130_frame_count - account a frame counter sample
+ * @ar0130: pointer to private data structure
+ * @count: FRAME_COUNT value
+ * @in_flight: frames the sensor started but the host can't have yet
+ *
+ * Nothing is accounted until the capture side reports its first frame,
+ * without ar0130_frame_done() callers the dropped count stays 0. The
+ * first sample after that only sets the reference, frames before it are
+ * assumed delivered. Samples are close enough for FRAME_COUNT not to
+ * wrap twice between them.
+ */
+static void ar0130_frame_count(struct ar0130_priv *ar0130, u16 count,
+				unsigned int in_flight)
+{
+	struct ar0130_frame_stats *fs = &ar0130->frames;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ar0130->frame_lock, flags);
+	if (!fs->delivered) {
+		spin_unlock_irqrestore(&ar0130->frame_lock, flags);
+		return;
+	}
+
+	if (fs->synced)
+		fs->produced += (u16)(count - fs->last_count);
+	else
+		fs->produced = fs->delivered + in_flight;
+	fs->last_count = count;
+	fs->synced = 1;
+	fs->samples++;
+	if (fs->produced > fs->delivered + in_flight)
+		fs->dropped = fs->produced - fs->delivered - in_flight;
+	spin_unlock_irqrestore(&ar0130->frame_lock, flags);
+}
+
+/*
+ * Samples FRAME_COUNT every AR0130_FRAME_SAMPLE_EVERY frame periods while
+ * streaming, whether or not frames get delivered, so a stalled capture
+ * side still shows up as dropped frames.
+ */
+static void ar0130_frame_work(struct work_struct *work)
+{
+	struct ar0130_priv *ar0130 = container_of(to_delayed_work(work),
+					struct ar0130_priv, frame_work);
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	struct ar0130_status status;
+	u32 period_us = 0;
+	int ret = -ENODEV;
+
+	mutex_lock(&ar0130->lock);
+	if (ar0130->power_count && ar0130->streaming &&
+	    !ar0130_power_wait(ar0130)) {
+		ret = ar0130_read_status(client, &status);
+		period_us = div_u64((u64)ar0130_active_frame_length(ar0130) *
+				ar0130->mode_timing[ar0130->res_index].line_ns,
+				NSEC_PER_USEC);
+	}
+	mutex_unlock(&ar0130->lock);
+
+	/* the frame being read out counts but isn't delivered yet */
+	if (ret == 0)
+		ar0130_frame_count(ar0130, status.frame_count, 1);
+	if (period_us)
+		schedule_delayed_work(&ar0130->frame_work, usecs_to_jiffies(
+				period_us * AR0130_FRAME_SAMPLE_EVERY) ? : 1);
+}
+
+/**
+ * ar0130_frame_done - report a frame delivered to the consumer
+ * @sd: the sensor subdev
+ * @meta: metadata parsed from the frame, NULL if not available
+ *
+ * Called by the capture side for every frame it hands over, from any
+ * context. Frames the sensor counted but nobody reported here are the
+ * dropped ones, counted from the first report on. @meta updates the frame counter sample in between the
+ * ones ar0130_frame_work() takes. Delivery intervals are compared with
+ * the frame period for jitter.
+ */
+void ar0130_frame_done(struct v4l2_subdev *sd,
+			const struct ar0130_frame_meta *meta)
+{
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	struct ar0130_frame_stats *fs = &ar0130->frames;
+	u32 period = ar0130_active_frame_length(ar0130) *
+			ar0130->mode_timing[ar0130->res_index].line_ns;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	s64 dt;
+
+	spin_lock_irqsave(&ar0130->frame_lock, flags);
+	if (++fs->delivered > 1) {
+		dt = ktime_to_ns(ktime_sub(now, fs->last));
+		fs->late += dt > period + period / 2;
+		dt = abs64(dt - period);
+		fs->jitter_max_ns = max_t(u64, fs->jitter_max_ns, dt);
+		fs->jitter_sum_ns += dt;
+		fs->intervals++;
+	}
+	fs->last = now;
+	spin_unlock_irqrestore(&ar0130->frame_lock, flags);
+
+	if (meta && (meta->valid & AR0130_META_FRAME_COUNT))
+		ar0130_frame_count(ar0130, meta->frame_count, 0);
+}
+EXPORT_SYMBOL_GPL(ar0130_frame_done);
+
+static struct v4l2_mbus_framefmt *
+__ar0130_get_pad_format(struct ar0130_priv *ar0130, struct v4l2_subdev_fh *fh,
+			unsigned int pad, u32 which)
+{
+	switch (which) {
+		case V4L2_SUBDEV_FORMAT_TRY:
+			return v4l2_subdev_get_try_format(fh, pad);
+		case V4L2_SUBDEV_FORMAT_ACTIVE:
+			return &ar0130->format;
+		default:
+			return NULL;
+	}
+}
+
+static struct v4l2_rect *
+__ar0130_get_pad_crop(struct ar0130_priv *ar0130, struct v4l2_subdev_fh *fh,
+			unsigned int pad, u32 which)
+{
+	switch (which) {
+		case V4L2_SUBDEV_FORMAT_TRY:
+			return v4l2_subdev_get_try_crop(fh, pad);
+		case V4L2_SUBDEV_FORMAT_ACTIVE:
+			return &ar0130->crop;
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * ar0130_load_hdr - fetch the HDR sequencer and analog setup
+ * @client: pointer to the i2c client
+ *
+ * Both come from the firmware file AR0130_HDR_FW and are kept once
+ * loaded.
+ */
+static int ar0130_load_hdr(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	const struct firmware *fw;
+	unsigned int i, words, seq_words, nregs;
+	struct ar0130_reg *regs;
+	u16 *seq;
+	int ret;
+
+	if (ar0130->hdr_seq)
+		return 0;
+
+	ret = request_firmware(&fw, AR0130_HDR_FW, &client->dev);
+	if (ret < 0) {
+		dev_err(&client->dev, "HDR firmware %s not available: %d\n",
+			AR0130_HDR_FW, ret);
+		return ret;
+	}
+
+	words = fw->size / 2;
+	seq_words = words ? (fw->data[0] << 8) | fw->data[1] : 0;
+	nregs = words > seq_words ? (words - 1 - seq_words) / 2 : 0;
+	if (fw->size % 2 || !seq_words || seq_words > AR0130_SEQ_MAX_WORDS ||
+	    words != 1 + seq_words + 2 * nregs ||
+	    nregs > AR0130_HDR_MAX_REGS) {
+		dev_err(&client->dev, "bad HDR firmware size %zu\n", fw->size);
+		ret = -EINVAL;
+		goto done;
+	}
+
+	seq = kmalloc(seq_words * sizeof(*seq), GFP_KERNEL);
+	regs = kmalloc(max(nregs, 1U) * sizeof(*regs), GFP_KERNEL);
+	if (seq == NULL || regs == NULL) {
+		kfree(seq);
+		kfree(regs);
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (i = 0; i < seq_words; i++)
+		seq[i] = (fw->data[2 + 2 * i] << 8) | fw->data[3 + 2 * i];
+	for (i = 0; i < nregs; i++) {
+		const u8 *p = fw->data + 2 + 2 * seq_words + 4 * i;
+
+		regs[i].addr = (p[0] << 8) | p[1];
+		regs[i].val = (p[2] << 8) | p[3];
+	}
+
+	ar0130->hdr_seq = seq;
+	ar0130->hdr_seq_words = seq_words;
+	ar0130->hdr_regs = regs;
+	ar0130->hdr_nregs = nregs;
+
+done:
+	release_firmware(fw);
+	return ret;
+}
+
+/**
+ * ar0130_operation_mode - OPERATION_MODE_CTRL for the HDR controls
+ * @ar0130: pointer to private data structure
+ *
+ */
+static u16 ar0130_operation_mode(struct ar0130_priv *ar0130)
+{
+	u16 ratio = AR0130_OP_MODE_RATIO_16X;
+	u16 mode = 0;
+
+	if (ar0130->hdr && ar0130->hdr->cur.val)
+		ratio = ar0130->hdr_ratio->cur.val;
+	else
+		mode = AR0130_OP_MODE_LINEAR;
+
+	return mode | ratio << AR0130_OP_MODE_RATIO_T1_T2_SHIFT
+		| ratio << AR0130_OP_MODE_RATIO_T2_T3_SHIFT;
+}
+
+/**
+ * ar0130_sensor_mode_setup - load the linear or HDR sequencer
+ * @client: pointer to the i2c client
+ *
+ * HDR merges three exposures, T1, T1 / ratio and T1 / ratio^2, on the
+ * sensor and compands the result to 12 bits, so the bus format does not
+ * change. Its analog setup comes with the sequencer and is written over
+ * the linear one.
+ */
+static int ar0130_sensor_mode_setup(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	unsigned int xfers = ar0130->i2c_xfers;
+	unsigned long bus_us = ar0130->i2c_bus_us;
+	u16 op_mode = ar0130_operation_mode(ar0130);
+	const u16 *seq = ar0130_linear_data;
+	unsigned int words = ARRAY_SIZE(ar0130_linear_data);
+	int hdr = !(op_mode & AR0130_OP_MODE_LINEAR);
+	ktime_t start;
+	int ret;
+
+	if (hdr) {
+		ret = ar0130_load_hdr(client);
+		if (ret < 0)
+			return ret;
+		seq = ar0130->hdr_seq;
+		words = ar0130->hdr_seq_words;
+	}
+
+	ret = ar0130_reg_write(client, AR0130_SEQ_CTRL_PORT, 0x8000);	// SEQ_CTRL_PORT
+	ret |= ar0130_burst_write(client, AR0130_SEQ_PORT, seq, words, 0);
+
+	/* one 4-byte write message per word is what the upload used to cost */
+	dev_dbg(&client->dev, "sequencer upload: %u transfers, %lu us on bus "
+		"(%u transfers, %u us as single writes)\n",
+		ar0130->i2c_xfers - xfers, ar0130->i2c_bus_us - bus_us,
+		words + 1, (words + 1) * DIV_ROUND_UP((1 + 5 * 9 + 1) * 1000, ar0130->i2c_khz));
+ 
+	ret |= ar0130_reg_write(client, 0x309E, 0x0000);	// DCDS_PROG_START_ADDR
+	ret |= ar0130_reg_write(client, 0x30E4, 0x6372);	// ADC_BITS_6_7
+	ret |= ar0130_reg_write(client, 0x30E2, 0x7253);	// ADC_BITS_4_5
+	ret |= ar0130_reg_write(client, 0x30E0, 0x5470);	// ADC_BITS_2_3
+	ret |= ar0130_reg_write(client, 0x30E6, 0xC4CC);	// ADC_CONFIG1
+	ret |= ar0130_reg_write(client, 0x30E8, 0x8050);	// ADC_CONFIG2
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * Nothing in FRAME_STATUS tracks the ADC settling, and the sensor sits
+	 * in standby here anyway, so keep the reference settle time. Sleep
+	 * through it rather than spin.
+	 */
+	start = ktime_get();
+	msleep(AR0130_ADC_SETTLE_MS);
+	ar0130->settle_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	ret |= ar0130_reg_write(client, AR0130_OPERATION_MODE, op_mode);
+	ret |= ar0130_reg_write(client, 0x30B0, 0x1300);	// DIGITAL_TEST
+	ret |= ar0130_reg_write(client, 0x30D4, 0xE007);	// COLUMN_CORRECTION
+	ret |= ar0130_reg_write(client, 0x301A, 0x10DC);	// RESET_REGISTER
+	ret |= ar0130_reg_write(client, 0x301A, 0x10D8);	// RESET_REGISTER
+	ret |= ar0130_reg_write(client, 0x3044, 0x0400);	// DARK_CONTROL
+	ret |= ar0130_reg_write(client, 0x3EDA, 0x0F03);	// DAC_LD_14_15
+	ret |= ar0130_reg_write(client, 0x3ED8, 0x01EF);	// DAC_LD_12_13
+	if (hdr)
+		ret |= ar0130_write_regs(client, ar0130->hdr_regs,
+					ar0130->hdr_nregs);
+	if (ret < 0)
+		return ret;
+
+	ar0130->op_mode = op_mode;
+	return 0;
+}
+
+/**
+ * ar0130_mode - mode database entry
+ * @res_index: mode to look up
+ *
+ */
+static const struct ar0130_mode *ar0130_mode(enum resolution res_index)
+{
+	if (res_index >= ARRAY_SIZE(ar0130_modes))
+		res_index = AR0130_FULL_RES_45FPS;
+
+	return &ar0130_modes[res_index];
+}
+
+/**
+ * ar0130_mode_scale - crop to output size ratio of a mode
+ * @mode: mode database entry
+ *
+ * Skipping and binning are symmetric in every mode, so one factor covers
+ * both axes.
+ */
+static unsigned int ar0130_mode_scale(const struct ar0130_mode *mode)
+{
+	return mode->bin * mode->skip;
+}
+
+/**
+ * ar0130_find_format - bus format of a media bus code
+ * @code: media bus code, in any Bayer order
+ *
+ * Returns NULL for unsupported codes.
+ */
+static const struct ar0130_format *ar0130_find_format(u32 code)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(ar0130_formats); i++)
+		for (j = 0; j < 4; j++)
+			if (ar0130_formats[i].codes[j / 2][j % 2] == code)
+				return &ar0130_formats[i];
+
+	return NULL;
+}
+
+/**
+ * ar0130_bayer_code - media bus code of a readout window
+ * @format: bus format
+ * @crop: readout window
+ *
+ * Skipping reads pixel pairs (odd increments), so the colour order only
+ * depends on the parity of the first row and column, for every skip
+ * factor.
+ */
+static enum v4l2_mbus_pixelcode ar0130_bayer_code(const struct ar0130_format *format,
+				const struct v4l2_rect *crop)
+{
+	return format->codes[crop->top & 1][crop->left & 1];
+}
+
+/**
+ * ar0130_embedded_rows - lines the sensor adds to the image
+ * @enabled: embedded data control value
+ *
+ * Register data rows precede the image and statistics rows follow it;
+ * the host captures both as part of the frame.
+ */
+static unsigned int ar0130_embedded_rows(int enabled)
+{
+	return enabled ? AR0130_EMBEDDED_DATA_ROWS + AR0130_EMBEDDED_STATS_ROWS : 0;
+}
+
+/**
+ * ar0130_set_bus_format - select the bus format of the active stream
+ * @ar0130: pointer to private data structure
+ * @format: bus format
+ *
+ * The board configures the ISP lane shifter and bridge for it; the ISP
+ * reads that configuration when the pipeline starts.
+ */
+static int ar0130_set_bus_format(struct ar0130_priv *ar0130,
+				const struct ar0130_format *format)
+{
+	int ret = format->bpp == 12 ? 0 : -EINVAL;
+
+	if (ar0130->pdata->set_bus_format)
+		ret = ar0130->pdata->set_bus_format(&ar0130->subdev,
+						format->bpp);
+	if (ret < 0)
+		return ret;
+
+	ar0130->bus_format = format;
+	return 0;
+}
+
+/**
+ * ar0130_build_mode - assemble the register list of the current mode
+ * @ar0130: pointer to private data structure
+ * @regs: filled with at most AR0130_MAX_MODE_REGS entries
+ *
+ * The mode's register table with the line length of the mode database,
+ * the readout window taken from the crop rectangle and the frame length
+ * chosen for the requested frame interval. Returns
+ * the number of entries.
+ */
+static unsigned int ar0130_build_mode(struct ar0130_priv *ar0130,
+				struct ar0130_reg *regs)
+{
+	const struct ar0130_mode *mode = ar0130_mode(ar0130->res_index);
+	const struct v4l2_rect *crop = &ar0130->crop;
+	unsigned int i;
+
+	for (i = 0; i < mode->regs.count; i++) {
+		regs[i] = mode->regs.regs[i];
+
+		switch (regs[i].addr) {
+		case AR0130_Y_ADDR_START:
+			regs[i].val = AR0130_ROW_OFFSET + crop->top;
+			break;
+		case AR0130_Y_ADDR_END:
+			regs[i].val = AR0130_ROW_OFFSET + crop->top
+					+ crop->height - 1;
+			break;
+		case AR0130_X_ADDR_START:
+			regs[i].val = crop->left;
+			break;
+		case AR0130_X_ADDR_END:
+			regs[i].val = crop->left + crop->width - 1;
+			break;
+		case AR0130_FRAME_LENGTH:
+			regs[i].val = ar0130_active_frame_length(ar0130);
+			break;
+		case AR0130_LINE_LENGTH:
+			regs[i].val = mode->line_length;
+			break;
+		}
+	}
+
+	return mode->regs.count;
+}
+
+static int ar0130_set_resolution(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	struct ar0130_reg regs[AR0130_MAX_MODE_REGS];
+	struct ar0130_reg_list from = { ar0130->mode_regs, ar0130->mode_count };
+	struct ar0130_reg_list to = { regs, 0 };
+	int ret;
+
+	to.count = ar0130_build_mode(ar0130, regs);
+
+	if (ar0130->mode_count)
+		ret = ar0130_write_regs_delta(client, &from, &to);
+	else
+		ret = ar0130_write_regs(client, regs, to.count);
+
+	if (ret < 0) {
+		ar0130->mode_count = 0;
+		return ret;
+	}
+
+	memcpy(ar0130->mode_regs, regs, to.count * sizeof(*regs));
+	ar0130->mode_count = to.count;
+	return 0;
+}
+
+/**
+ * ar0130_pixel_clock - pixel clock of the PLL setup, in Hz
+ * @ar0130: pointer to private data structure
+ *
+ */
+static u32 ar0130_pixel_clock(struct ar0130_priv *ar0130)
+{
+	return ar0130->pll.pix_clk;
+}
+
+/**
+ * ar0130_min_frame_length - shortest frame length for a window
+ * @mode: mode reading the window out
+ * @height: window height in sensor rows
+ *
+ * Skipped rows are not read out and take no line time.
+ */
+static unsigned int ar0130_min_frame_length(const struct ar0130_mode *mode,
+				unsigned int height)
+{
+	return height / mode->skip + AR0130_VBLANK_MIN;
+}
+
+/**
+ * ar0130_frame_interval - frame interval of a frame length
+ * @ar0130: pointer to private data structure
+ * @mode: mode giving the line length
+ * @frame_length: frame length in lines
+ * @interval: filled with the interval in lowest terms
+ *
+ */
+static void ar0130_frame_interval(struct ar0130_priv *ar0130,
+				const struct ar0130_mode *mode,
+				unsigned int frame_length,
+				struct v4l2_fract *interval)
+{
+	u32 pclk = ar0130_pixel_clock(ar0130);
+	u32 pcks = frame_length * mode->line_length;
+	unsigned long div = gcd(pcks, pclk);
+
+	interval->numerator = pcks / div;
+	interval->denominator = pclk / div;
+}
+
+/**
+ * ar0130_init_modes - compute the timing of every mode
+ * @ar0130: pointer to private data structure
+ *
+ * Depends on the pixel clock, so runs once the PLL setup is known. The
+ * frame interval ops and the mode selection read the line time and the
+ * fastest interval from here.
+ */
+static void ar0130_init_modes(struct ar0130_priv *ar0130)
+{
+	u32 pclk = ar0130_pixel_clock(ar0130);
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(ar0130_modes); i++) {
+		const struct ar0130_mode *mode = &ar0130_modes[i];
+		struct ar0130_mode_timing *t = &ar0130->mode_timing[i];
+		unsigned int lines = ar0130_min_frame_length(mode,
+					mode->height * ar0130_mode_scale(mode));
+		u64 pcks = (u64)lines * mode->line_length;
+
+		t->line_ns = div_u64((u64)mode->line_length * NSEC_PER_SEC, pclk);
+		t->frame_length = lines;
+		ar0130_frame_interval(ar0130, mode, lines, &t->min_interval);
+		t->frame_us = div_u64(pcks * USEC_PER_SEC, pclk);
+		t->pixel_rate = div_u64((u64)mode->width * mode->height * pclk,
+					pcks);
+	}
+}
+
+/**
+ * ar0130_update_timing - derive the frame length from the frame interval
+ * @ar0130: pointer to private data structure
+ *
+ * The window rows plus the minimum vertical blanking is the shortest
+ * frame, so narrow strips run much faster than full frames. Longer
+ * intervals add vertical blanking lines.
+ */
+static void ar0130_update_timing(struct ar0130_priv *ar0130)
+{
+	const struct ar0130_mode *mode = ar0130_mode(ar0130->res_index);
+	const struct ar0130_mode_timing *t =
+			&ar0130->mode_timing[ar0130->res_index];
+	unsigned int min = ar0130_min_frame_length(mode, ar0130->crop.height);
+	u64 lines = 0;
+
+	if (ar0130->interval.numerator && ar0130->interval.denominator) {
+		lines = (u64)ar0130->interval.numerator * NSEC_PER_SEC;
+		lines = div_u64(lines, ar0130->interval.denominator);
+		lines = div_u64(lines, t->line_ns);
+	}
+
+	ar0130->frame_length = clamp_t(u64, lines, min, AR0130_FRAME_LENGTH_MAX);
+	ar0130->afr_length = 0;
+}
+
+/* what reading a field of view out with one mode costs */
+struct ar0130_mode_cost {
+	int fast;		/* meets the requested frame interval */
+	int covers;		/* output at least the requested size */
+	unsigned int rows;	/* rows read out per frame */
+	unsigned int pixels;	/* output pixels per frame */
+	int native;		/* output is the mode's own size */
+};
+
+static int ar0130_mode_cost_better(const struct ar0130_mode_cost *a,
+				const struct ar0130_mode_cost *b)
+{
+	if (a->fast != b->fast)
+		return a->fast;
+	if (a->covers != b->covers)
+		return a->covers;
+	if (a->covers && a->rows != b->rows)
+		return a->rows < b->rows;
+	if (a->pixels != b->pixels)
+		return a->covers ? a->pixels < b->pixels : a->pixels > b->pixels;
+	return a->native > b->native;
+}
+
+/**
+ * ar0130_select_mode - choose the mode and window for an output size
+ * @ar0130: pointer to private data structure
+ * @width: requested output width
+ * @height: requested output height
+ * @crop: filled with the readout window
+ *
+ * The field of view is the largest window of the requested aspect ratio
+ * centred on the pixel array. Every mode reads it out at its own scale;
+ * preferred are, in order, modes meeting the requested frame interval,
+ * modes whose output is not smaller than requested, then the fewest
+ * rows read out and the lowest pixel rate. A 1280x400 request thus
+ * reads 400 rows instead of a 1280x720 frame.
+ */
+static enum resolution ar0130_select_mode(struct ar0130_priv *ar0130,
+				u32 width, u32 height, struct v4l2_rect *crop)
+{
+	const struct v4l2_fract *interval = &ar0130->interval;
+	u32 fov_w = AR0130_PIXEL_ARRAY_WIDTH;
+	u32 fov_h = AR0130_PIXEL_ARRAY_HEIGHT;
+	struct ar0130_mode_cost cost, best_cost;
+	enum resolution best = AR0130_FULL_RES_45FPS;
+	unsigned int i;
+
+	width = max_t(u32, width, 1);
+	height = max_t(u32, height, 1);
+
+	if ((u64)width * fov_h >= (u64)height * fov_w)
+		fov_h = max_t(u32, div_u64((u64)fov_w * height, width),
+				AR0130_CROP_HEIGHT_MIN);
+	else
+		fov_w = max_t(u32, div_u64((u64)fov_h * width, height),
+				AR0130_CROP_WIDTH_MIN);
+
+	memset(&best_cost, 0, sizeof(best_cost));
+	crop->width = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ar0130_modes); i++) {
+		const struct ar0130_mode *mode = &ar0130_modes[i];
+		const struct ar0130_mode_timing *t = &ar0130->mode_timing[i];
+		unsigned int scale = ar0130_mode_scale(mode);
+		u32 w = fov_w & ~(2 * scale - 1);
+		u32 h = fov_h & ~(2 * scale - 1);
+
+		if (w < AR0130_CROP_WIDTH_MIN || h < AR0130_CROP_HEIGHT_MIN * scale)
+			continue;
+
+		cost.rows = h / mode->skip;
+		cost.pixels = (w / scale) * (h / scale);
+		cost.covers = w / scale >= width && h / scale >= height;
+		cost.native = w / scale == mode->width && h / scale == mode->height;
+		cost.fast = 1;
+		if (interval->numerator && interval->denominator)
+			cost.fast = (u64)ar0130_min_frame_length(mode, h)
+					* t->line_ns * interval->denominator
+				<= (u64)interval->numerator * NSEC_PER_SEC;
+
+		if (crop->width && !ar0130_mode_cost_better(&cost, &best_cost))
+			continue;
+
+		best = i;
+		best_cost = cost;
+		crop->width = w;
+		crop->height = h;
+	}
+
+	if (!crop->width) {
+		crop->width = AR0130_PIXEL_ARRAY_WIDTH;
+		crop->height = AR0130_PIXEL_ARRAY_HEIGHT;
+	}
+
+	crop->left = ((AR0130_PIXEL_ARRAY_WIDTH - crop->width) / 2) & ~1;
+	crop->top = ((AR0130_PIXEL_ARRAY_HEIGHT - crop->height) / 2) & ~1;
+
+	return best;
+}
+
+/**
+ * ar0130_group_hold - collect register updates for one frame boundary
+ * @client: pointer to the i2c client
+ * @hold: 1 to start holding updates, 0 to release them together
+ *
+ * Registers written while the grouped parameter hold is set take effect
+ * together at the start of the next frame after it is released, without
+ * interrupting the stream. Holds nest; only the outermost release lets
+ * the updates through.
+ */
+static int ar0130_group_hold(struct i2c_client *client, int hold)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	int reset, ret;
+
+	if (hold && ar0130->hold_depth) {
+		ar0130->hold_depth++;
+		return 0;
+	}
+	if (!hold) {
+		if (WARN_ON(!ar0130->hold_depth))
+			return -EINVAL;
+		/* released even if the write fails, the next hold rewrites it */
+		if (--ar0130->hold_depth)
+			return 0;
+	}
+
+	reset = ar0130_reg_read(client, AR0130_RESET_REG);
+	if (reset < 0)
+		return reset;
+
+	if (hold)
+		reset |= AR0130_GROUPED_HOLD;
+	else
+		reset &= ~AR0130_GROUPED_HOLD;
+
+	ret = ar0130_reg_write(client, AR0130_RESET_REG, reset);
+	if (ret < 0)
+		return ret;
+
+	/* a failed hold is not taken, callers return without releasing */
+	if (hold)
+		ar0130->hold_depth = 1;
+	return 0;
+}
+
+/**
+ * ar0130_ctrl_val - value of a control for a register write
+ * @ctrl: control to read
+ * @setting: control s_ctrl is setting, NULL outside s_ctrl
+ *
+ * Only the cluster being set holds its new value in ->val, the value of
+ * any other control may be left over from a try.
+ */
+static s32 ar0130_ctrl_val(struct v4l2_ctrl *ctrl, struct v4l2_ctrl *setting)
+{
+	if (setting && ctrl->cluster == setting->cluster)
+		return ctrl->val;
+
+	return ctrl->cur.val;
+}
+
+/**
+ * ar0130_ae_max_exposure - longest integration AE may pick
+ * @ar0130: pointer to private data structure
+ * @limit: "AE Max Exposure" control value
+ *
+ * The control applies to the frame length of the frame interval. Lines
+ * added by auto frame rate extend it by as much.
+ */
+static u16 ar0130_ae_max_exposure(struct ar0130_priv *ar0130, u32 limit)
+{
+	unsigned int length = ar0130_active_frame_length(ar0130);
+
+	return min_t(unsigned int, limit + length - ar0130->frame_length,
+			length - 1);
+}
+
+/**
+ * ar0130_min_exposure - shortest integration the operating mode allows
+ * @ar0130: pointer to private data structure
+ *
+ * In HDR the shortest exposure, T1 / ratio^2, needs at least one line.
+ */
+static u32 ar0130_min_exposure(struct ar0130_priv *ar0130)
+{
+	u32 ratio;
+
+	if (!ar0130->hdr->cur.val)
+		return AR0130_EXPOSURE_MIN;
+
+	ratio = 4 << ar0130->hdr_ratio->cur.val;
+	return min_t(u32, ratio * ratio, ar0130->frame_length - 1);
+}
+
+/**
+ * ar0130_write_ae_tuning - program the AE engine from its tuning controls
+ * @ar0130: pointer to private data structure
+ * @setting: control s_ctrl is setting, NULL outside s_ctrl
+ *
+ * Takes effect at the next frame boundary, so it may be used while
+ * streaming; unchanged registers are skipped by the cache.
+ */
+static int ar0130_write_ae_tuning(struct ar0130_priv *ar0130,
+				struct v4l2_ctrl *setting)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	u16 max_exp = ar0130_ae_max_exposure(ar0130,
+			ar0130_ctrl_val(ar0130->ae_max_exposure, setting));
+	int ret;
+
+	ret = ar0130_group_hold(client, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = ar0130_reg_write(client, AR0130_AE_LUMA_TARGET,
+			ar0130_ctrl_val(ar0130->ae_target, setting));
+	ret |= ar0130_reg_write(client, AR0130_AE_ALPHA_V1,
+			ar0130_ctrl_val(ar0130->ae_alpha, setting));
+	ret |= ar0130_reg_write(client, AR0130_AE_MAX_EXPOSURE, max_exp);
+	ret |= ar0130_reg_write(client, AR0130_AE_MIN_EXPOSURE,
+			clamp_t(u32, ar0130_ctrl_val(ar0130->ae_min_exposure,
+			setting), ar0130_min_exposure(ar0130), max_exp));
+	ret |= ar0130_reg_write(client, AR0130_AE_DCG_EXPOSURE_HIGH,
+			ar0130_ctrl_val(ar0130->ae_dcg_high, setting));
+	ret |= ar0130_reg_write(client, AR0130_AE_DCG_EXPOSURE_LOW,
+			ar0130_ctrl_val(ar0130->ae_dcg_low, setting));
+
+	ret |= ar0130_group_hold(client, 0);
+	return ret;
+}
+
+static int ar0130_set_autoexposure(struct i2c_client *client, int enable)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	int ret;
+
+	ret = ar0130_group_hold(client, 1);
+	if (ret < 0)
+		return ret;
+
+	ar0130_cache_drop_ae(ar0130);
+
+	if(enable){
+		ar0130->autoexposure = 1;
+		ret = ar0130_reg_write(client, 0x3100, 0x001B);		// AE_CTRL_REG
+		ret |= ar0130_reg_write(client, 0x3116, 0x02C0);	// AE_DCG_GAIN_FACTOR_REG
+		ret |= ar0130_reg_write(client, 0x3118, 0x005B);	// AE_DCG_GAIN_FACTOR_INV_REG
+		ret |= ar0130_reg_write(client, 0x3104, 0x1000);	// AE_HIST_TARGET_REG
+		ret |= ar0130_write_ae_tuning(ar0130, NULL);
+	}
+	else {
+		ar0130->autoexposure = 0;
+		ret = ar0130_reg_write(client, 0x3100, 0x001A);		// AE_CTRL_REG
+	}
+
+	ret |= ar0130_group_hold(client, 0);
+	return ret;
+}
+
+/**
+ * ar0130_write_exposure - set integration time and gains for one frame
+ * @ar0130: pointer to private data structure
+ * @integration: coarse integration time in lines
+ * @gain: global gain, xxx.yyyyy
+ * @column: column gain, 1x << column
+ *
+ * Callers hold the registers with ar0130_group_hold() so the three land
+ * on the same frame.
+ */
+static int ar0130_write_exposure(struct ar0130_priv *ar0130, u16 integration,
+				u16 gain, u16 column)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	int test, ret;
+
+	integration = max_t(u32, integration, ar0130_min_exposure(ar0130));
+	ret = ar0130_reg_write(client, AR0130_COARSE_INT_TIME, integration);
+	ret |= ar0130_reg_write(client, AR0130_GLOBAL_GAIN, gain);
+
+	test = ar0130_reg_read(client, AR0130_DIGITAL_TEST);
+	if (test >= 0) {
+		test &= ~AR0130_COLUMN_GAIN_MASK;
+		test |= column << AR0130_COLUMN_GAIN_SHIFT;
+		ret |= ar0130_reg_write(client, AR0130_DIGITAL_TEST, test);
+	} else {
+		ret |= test;
+	}
+
+	return ret;
+}
+
+/************************************************************************
+			software AE
+************************************************************************/
+/**
+ * ar0130_sw_ae_step - one iteration of the software AE loop
+ * @ar0130: pointer to private data structure
+ * @frames: sensor frames since the previous step, at least one
+ *
+ * Moves the total exposure halfway to the one that brings AE_MEAN_L to
+ * the luma target, by at most 4x per step, then splits it into
+ * integration time first, column gain next and global gain last. The
+ * luma target and exposure limits are shared with the AE engine. Frames
+ * still exposed with the previous values are only measured. Latency and
+ * convergence are counted in sensor frames, not in steps.
+ */
+static int ar0130_sw_ae_step(struct ar0130_priv *ar0130, unsigned int frames)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	struct ar0130_sw_ae *ae = &ar0130->ae;
+	u32 target = ar0130->ae_target->cur.val;
+	u32 min_int = max_t(u32, ar0130->ae_min_exposure->cur.val,
+				ar0130_min_exposure(ar0130));
+	u32 max_int = ar0130_ae_max_exposure(ar0130,
+				ar0130->ae_max_exposure->cur.val);
+	u32 mean, integration, gain;
+	u16 column = 0;
+	u64 exposure, wanted;
+	int settled, ret;
+
+	ret = ar0130_reg_read(client, AR0130_AE_MEAN);
+	if (ret < 0)
+		return ret;
+
+	mean = max_t(u32, (ret * ae->sim_gain) / AR0130_AE_SIM_UNITY, 1);
+	settled = abs((s32)mean - (s32)target) <=
+			(target >> AR0130_AE_TOLERANCE_SHIFT);
+	ae->mean = mean;
+	ae->iterations++;
+
+	if (ae->step_pending) {
+		ae->step_frames += frames;
+		ae->stable = settled ? ae->stable + frames : 0;
+		if (ae->stable >= AR0130_AE_STABLE_FRAMES) {
+			ae->converge_frames = ae->step_frames;
+			ae->converge_us = ktime_us_delta(ktime_get(),
+							ae->step_start);
+			ae->step_pending = 0;
+		}
+	}
+
+	if (ae->settle > frames) {
+		ae->settle -= frames;
+		return 0;
+	}
+	ae->settle = 0;
+	if (settled)
+		return 0;
+
+	exposure = ((u64)ae->integration * ae->gain) << ae->column;
+	wanted = div_u64(exposure * target, mean);
+	wanted = clamp_t(u64, wanted, exposure / 4, exposure * 4);
+	wanted = (exposure + wanted) / 2;
+
+	integration = clamp_t(u64, div_u64(wanted, AR0130_GLOBAL_GAIN_DEF),
+				min_t(u32, min_int, max_int), max_int);
+	gain = div_u64(wanted, integration);
+	while (column < AR0130_COLUMN_GAIN_MAX &&
+	       gain >= (2 * AR0130_GLOBAL_GAIN_DEF) << column)
+		column++;
+	gain = clamp_t(u32, gain >> column, AR0130_GLOBAL_GAIN_DEF,
+			AR0130_GLOBAL_GAIN_MAX);
+
+	if (integration == ae->integration && gain == ae->gain &&
+	    column == ae->column)
+		return 0;
+
+	ret = ar0130_group_hold(client, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = ar0130_write_exposure(ar0130, integration, gain, column);
+	ret |= ar0130_group_hold(client, 0);
+	if (ret < 0)
+		return ret;
+
+	ae->integration	= integration;
+	ae->gain	= gain;
+	ae->column	= column;
+	ae->settle	= AR0130_AE_LATENCY;
+	return 0;
+}
+
+/**
+ * ar0130_afr_apply - set the auto frame rate frame length
+ * @ar0130: pointer to private data structure
+ * @length: frame length in lines, at most the interval's one for none
+ *
+ * FRAME_LENGTH_LINES and AE_MAX_EXPOSURE change in the same frame, so the
+ * AE never sees a limit that doesn't fit the frame.
+ */
+static int ar0130_afr_apply(struct ar0130_priv *ar0130, unsigned int length)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	int ret;
+
+	ar0130->afr_length = length > ar0130->frame_length ? length : 0;
+	if (!ar0130->mode_count)
+		return 0;
+
+	ret = ar0130_group_hold(client, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = ar0130_set_resolution(client);
+	ret |= ar0130_write_ae_tuning(ar0130, NULL);
+
+	ret |= ar0130_group_hold(client, 0);
+	return ret;
+}
+
+/**
+ * ar0130_afr_floor_length - frame length of the lowest frame rate allowed
+ * @ar0130: pointer to private data structure
+ *
+ */
+static unsigned int ar0130_afr_floor_length(struct ar0130_priv *ar0130)
+{
+	u32 line_ns = ar0130->mode_timing[ar0130->res_index].line_ns;
+	u64 lines = div_u64(NSEC_PER_SEC, line_ns * ar0130->afr_fps_min);
+
+	return clamp_t(u64, lines, ar0130->frame_length,
+			AR0130_FRAME_LENGTH_MAX);
+}
+
+/**
+ * ar0130_afr_step - one iteration of the auto frame rate policy
+ * @ar0130: pointer to private data structure
+ *
+ * Runs on the exposure the AE picked. Once it integrates up to its limit
+ * and adds gain, frames get 25% longer down to the floor rate; once it is
+ * back at unity gain with over a third of the limit unused, they shorten
+ * again up to the frame interval, the ceiling.
+ */
+static int ar0130_afr_step(struct ar0130_priv *ar0130)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	unsigned int length = ar0130_active_frame_length(ar0130);
+	unsigned int floor = ar0130_afr_floor_length(ar0130);
+	struct ar0130_status status;
+	u32 max_exp;
+	int gained, ret;
+
+	if (length > floor)
+		return ar0130_afr_apply(ar0130, floor);
+
+	ret = ar0130_read_status(client, &status);
+	if (ret < 0)
+		return ret;
+
+	max_exp = ar0130_ae_max_exposure(ar0130,
+				ar0130->ae_max_exposure->cur.val);
+	gained = status.global_gain > AR0130_GLOBAL_GAIN_DEF ||
+		 (status.digital_test & AR0130_COLUMN_GAIN_MASK);
+
+	if (gained && length < floor &&
+	    status.integration + (max_exp >> 4) >= max_exp)
+		return ar0130_afr_apply(ar0130, min(length + length / 4, floor));
+
+	if (!gained && length > ar0130->frame_length &&
+	    status.integration < max_exp * 5 / 8)
+		return ar0130_afr_apply(ar0130, length - length / 5);
+
+	return 0;
+}
+
+/**
+ * ar0130_ae_kick - run the AE work now if it has anything to do
+ * @ar0130: pointer to private data structure
+ *
+ */
+static void ar0130_ae_kick(struct ar0130_priv *ar0130)
+{
+	if (ar0130->streaming && (ar0130->ae.enabled || ar0130->afr_enabled))
+		schedule_delayed_work(&ar0130->ae_work, 0);
+}
+
+static void ar0130_ae_work(struct work_struct *work)
+{
+	struct ar0130_priv *ar0130 = container_of(to_delayed_work(work),
+					struct ar0130_priv, ae_work);
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	unsigned int frames = 0;
+	u32 period_us;
+	int run, ret = 0;
+
+	mutex_lock(&ar0130->lock);
+	run = ar0130->power_count && ar0130->streaming &&
+		(ar0130->ae.enabled || ar0130->afr_enabled);
+	if (run)
+		ret = ar0130_power_wait(ar0130);
+	if (run && ret == 0) {
+		/* the timer only approximates the frame period, count frames */
+		ret = ar0130_reg_read(client, AR0130_FRAME_COUNT);
+		if (ret >= 0) {
+			if (ar0130->ae_synced)
+				frames = (u16)(ret - ar0130->ae_frame_count);
+			ar0130->ae_frame_count = ret;
+			ar0130->ae_synced = 1;
+			ret = 0;
+		}
+	}
+	if (frames) {
+		if (ar0130->ae.enabled)
+			ret = ar0130_sw_ae_step(ar0130, frames);
+		ar0130->afr_frames += frames;
+		if (ret == 0 && ar0130->afr_enabled &&
+		    ar0130->afr_frames >= AR0130_AFR_EVERY) {
+			ar0130->afr_frames = 0;
+			ret = ar0130_afr_step(ar0130);
+		}
+	}
+	period_us = div_u64((u64)ar0130_active_frame_length(ar0130) *
+			ar0130->mode_timing[ar0130->res_index].line_ns,
+			NSEC_PER_USEC);
+	mutex_unlock(&ar0130->lock);
+
+	if (ret < 0)
+		dev_dbg(ar0130->subdev.v4l2_dev->dev,
+			"AE step failed: %d\n", ret);
+	if (run)
+		schedule_delayed_work(&ar0130->ae_work,
+				usecs_to_jiffies(period_us) ? : 1);
+}
+
+/**
+ * ar0130_sw_ae_start - hand exposure to the software AE loop
+ * @ar0130: pointer to private data structure
+ *
+ * Starts from the manual values; the loop runs while streaming.
+ */
+static void ar0130_sw_ae_start(struct ar0130_priv *ar0130)
+{
+	struct ar0130_sw_ae *ae = &ar0130->ae;
+
+	ae->integration	= ar0130->exposure->cur.val;
+	ae->gain	= max_t(u16, ar0130->gain->cur.val,
+				AR0130_GLOBAL_GAIN_DEF);
+	ae->column	= ar0130->again->cur.val;
+	ae->settle	= 0;
+	ae->enabled	= 1;
+
+	ar0130_ae_kick(ar0130);
+}
+
+/* ar0130_ae_work() checks the flag under the lock, no need to wait */
+static void ar0130_sw_ae_stop(struct ar0130_priv *ar0130)
+{
+	ar0130->ae.enabled = 0;
+	ar0130_ae_kick(ar0130);
+}
+
+/**
+ * ar0130_afr_enable - let AE lower the frame rate, or restore it
+ * @ar0130: pointer to private data structure
+ * @enable: auto frame rate wanted
+ *
+ * Called with ar0130->lock held.
+ */
+static int ar0130_afr_enable(struct ar0130_priv *ar0130, int enable)
+{
+	int ret = 0;
+
+	ar0130->afr_enabled = enable;
+	if (!enable && ar0130->afr_length)
+		ret = ar0130_afr_apply(ar0130, 0);
+
+	ar0130_ae_kick(ar0130);
+	return ret;
+}
+
+/************************************************************************
+			v4l2_ctrl_ops
+************************************************************************/
+/**
+ * ar0130_update_exposure_range - limit exposure controls to the frame length
+ * @ar0130: pointer to private data structure
+ *
+ */
+static void ar0130_update_exposure_range(struct ar0130_priv *ar0130)
+{
+	struct v4l2_ctrl *ctrls[] = {
+		ar0130->exposure,
+		ar0130->ae_max_exposure,
+		ar0130->ae_min_exposure,
+	};
+	s32 max = ar0130->frame_length - 1;
+	unsigned int i;
+
+	/* all controls share the handler lock */
+	v4l2_ctrl_lock(ar0130->exposure);
+	for (i = 0; i < ARRAY_SIZE(ctrls); i++) {
+		ctrls[i]->maximum = max;
+		if (ctrls[i]->cur.val > max)
+			ctrls[i]->cur.val = max;
+		if (ctrls[i]->val > max)
+			ctrls[i]->val = max;
+	}
+	v4l2_ctrl_unlock(ar0130->exposure);
+}
+
+static int ar0130_set_manual_exposure(struct ar0130_priv *ar0130)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	int ret;
+
+	ret = ar0130_group_hold(client, 1);
+	if (ret < 0)
+		return ret;
+
+	if (ar0130->autoexposure)
+		ret = ar0130_set_autoexposure(client, DISABLE);
+
+	ret |= ar0130_write_exposure(ar0130, ar0130->exposure->val,
+				ar0130->gain->val, ar0130->again->val);
+
+	ret |= ar0130_group_hold(client, 0);
+	return ret;
+}
+
+/**
+ * ar0130_set_exposure_mode - switch between manual, sensor and software AE
+ * @ar0130: pointer to private data structure
+ * @exposure_auto: V4L2_CID_EXPOSURE_AUTO value
+ * @algorithm: V4L2_CID_AR0130_AE_ALGORITHM value
+ *
+ */
+static int ar0130_set_exposure_mode(struct ar0130_priv *ar0130,
+				int exposure_auto, int algorithm)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	int ret = 0;
+
+	if (exposure_auto != V4L2_EXPOSURE_AUTO) {
+		ar0130_sw_ae_stop(ar0130);
+		ret = ar0130_afr_enable(ar0130, 0);
+		return ret | ar0130_set_manual_exposure(ar0130);
+	}
+
+	if (algorithm == AR0130_AE_SENSOR) {
+		ar0130_sw_ae_stop(ar0130);
+		ret = ar0130_set_autoexposure(client, ENABLE);
+	} else {
+		if (ar0130->autoexposure)
+			ret = ar0130_set_autoexposure(client, DISABLE);
+		if (!ar0130->ae.enabled)
+			ar0130_sw_ae_start(ar0130);
+	}
+
+	return ret | ar0130_afr_enable(ar0130, ar0130->auto_priority->cur.val);
+}
+
+static int __ar0130_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct ar0130_priv *ar0130 = container_of(ctrl->handler, struct ar0130_priv, ctrls);
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	struct ar0130_status status;
+	int ret;
+
+	if (ctrl->id == V4L2_CID_AR0130_DROPPED_FRAMES) {
+		ctrl->val = ar0130->frames.dropped;
+		return 0;
+	}
+
+	if (!ar0130->power_count)
+		return 0;
+
+	ret = ar0130_power_wait(ar0130);
+	if (ret < 0)
+		return ret;
+
+	switch (ctrl->id) {
+	case V4L2_CID_EXPOSURE_AUTO:
+		/* AE owns the cluster, report what it picked */
+		ret = ar0130_read_status(client, &status);
+		if (ret < 0)
+			return ret;
+		ar0130->exposure->val = status.integration;
+		ar0130->gain->val = status.global_gain;
+		ar0130->again->val = (status.digital_test & AR0130_COLUMN_GAIN_MASK)
+					>> AR0130_COLUMN_GAIN_SHIFT;
+		break;
+	}
+
+	return 0;
+}
+
+static int ar0130_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct ar0130_priv *ar0130 = container_of(ctrl->handler, struct ar0130_priv, ctrls);
+	int ret;
+
+	mutex_lock(&ar0130->lock);
+	ret = __ar0130_g_volatile_ctrl(ctrl);
+	mutex_unlock(&ar0130->lock);
+
+	return ret;
+}
+
+static int ar0130_try_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct ar0130_priv *ar0130 = container_of(ctrl->handler, struct ar0130_priv, ctrls);
+
+	/* keep the pairs ordered, the low end gives way */
 	switch (ctrl->id) {
-		case V4L2_CID_EXPOSURE_AUTO:
-			ret =  ar0130_set_autoexposure(client, ctrl->value);
+	case V4L2_CID_AR0130_AE_MAX_EXPOSURE:
+		if (ar0130->ae_min_exposure->val > ctrl->val)
+			ar0130->ae_min_exposure->val = ctrl->val;
+		break;
+	case V4L2_CID_AR0130_AE_DCG_HIGH:
+		if (ar0130->ae_dcg_low->val > ctrl->val)
+			ar0130->ae_dcg_low->val = ctrl->val;
 		break;
 	}
 
+	return 0;
+}
+
+static int __ar0130_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct ar0130_priv *ar0130 = container_of(ctrl->handler, struct ar0130_priv, ctrls);
+	int ret;
+
+	/* embedded rows are part of the frame, written on stream start */
+	if (ctrl->id == V4L2_CID_AR0130_EMBEDDED_DATA) {
+		ar0130->format.height += ar0130_embedded_rows(ctrl->val);
+		ar0130->format.height -= ar0130_embedded_rows(ctrl->cur.val);
+		return 0;
+	}
+
+	/* values are applied by v4l2_ctrl_handler_setup() on stream start */
+	if (!ar0130->power_count)
+		return 0;
+
+	ret = ar0130_power_wait(ar0130);
+	if (ret < 0)
+		return ret;
+
+	switch (ctrl->id) {
+	case V4L2_CID_EXPOSURE_AUTO:
+		return ar0130_set_exposure_mode(ar0130, ctrl->val,
+					ar0130->ae_algorithm->cur.val);
+	case V4L2_CID_AR0130_AE_ALGORITHM:
+		/* manual exposure doesn't use it, and its values aren't new */
+		if (ar0130->exposure_auto->cur.val != V4L2_EXPOSURE_AUTO)
+			return 0;
+		return ar0130_set_exposure_mode(ar0130,
+					ar0130->exposure_auto->cur.val,
+					ctrl->val);
+	case V4L2_CID_EXPOSURE_AUTO_PRIORITY:
+		return ar0130_afr_enable(ar0130, ctrl->val &&
+			ar0130->exposure_auto->cur.val == V4L2_EXPOSURE_AUTO);
+	case V4L2_CID_AR0130_FRAME_RATE_MIN:
+		/* the floor is checked on the next step */
+		ar0130->afr_fps_min = ctrl->val;
+		return 0;
+	case V4L2_CID_AR0130_AE_LUMA_TARGET:
+	case V4L2_CID_AR0130_AE_ALPHA:
+	case V4L2_CID_AR0130_AE_MAX_EXPOSURE:
+	case V4L2_CID_AR0130_AE_DCG_HIGH:
+		return ar0130_write_ae_tuning(ar0130, ctrl);
+	}
+
+	return 0;
+}
+
+static int ar0130_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct ar0130_priv *ar0130 = container_of(ctrl->handler, struct ar0130_priv, ctrls);
+	int ret;
+
+	mutex_lock(&ar0130->lock);
+	ret = __ar0130_s_ctrl(ctrl);
+	mutex_unlock(&ar0130->lock);
+
 	return ret;
 }
 
+static const struct v4l2_ctrl_ops ar0130_ctrl_ops = {
+	.g_volatile_ctrl	= ar0130_g_volatile_ctrl,
+	.try_ctrl		= ar0130_try_ctrl,
+	.s_ctrl			= ar0130_s_ctrl,
+};
+
+static const char * const ar0130_hdr_ratio_menu[] = {
+	"4x", "8x", "16x", "32x",
+};
+
+static const char * const ar0130_ae_algorithm_menu[] = {
+	[AR0130_AE_SENSOR]	= "Sensor",
+	[AR0130_AE_SOFTWARE]	= "Software",
+};
+
+static const struct v4l2_ctrl_config ar0130_ctrls[] = {
+	{
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_EMBEDDED_DATA,
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.name		= "Embedded Data",
+		.min		= 0,
+		.max		= 1,
+		.step		= 1,
+		.def		= 0,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_DROPPED_FRAMES,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "Dropped Frames",
+		.min		= 0,
+		.max		= 0x7FFFFFFF,
+		.step		= 1,
+		.def		= 0,
+		.flags		= V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_READ_ONLY,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_ALGORITHM,
+		.type		= V4L2_CTRL_TYPE_MENU,
+		.name		= "AE Algorithm",
+		.min		= 0,
+		.max		= ARRAY_SIZE(ar0130_ae_algorithm_menu) - 1,
+		.def		= AR0130_AE_SENSOR,
+		.qmenu		= ar0130_ae_algorithm_menu,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_LUMA_TARGET,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "AE Luma Target",
+		.min		= 0,
+		.max		= AR0130_AE_LUMA_TARGET_MAX,
+		.step		= 1,
+		.def		= AR0130_AE_LUMA_TARGET_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_ALPHA,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "AE Alpha",
+		.min		= 0,
+		.max		= 0xFFFF,
+		.step		= 1,
+		.def		= AR0130_AE_ALPHA_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_MAX_EXPOSURE,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "AE Max Exposure",
+		.min		= AR0130_EXPOSURE_MIN,
+		.max		= AR0130_FRAME_LENGTH_MAX - 1,	/* frame length - 1 */
+		.step		= 1,
+		.def		= AR0130_AE_MAX_EXPOSURE_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_MIN_EXPOSURE,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "AE Min Exposure",
+		.min		= AR0130_EXPOSURE_MIN,
+		.max		= AR0130_FRAME_LENGTH_MAX - 1,	/* frame length - 1 */
+		.step		= 1,
+		.def		= AR0130_AE_MIN_EXPOSURE_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_DCG_HIGH,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "AE DCG Exposure High",
+		.min		= 0,
+		.max		= 0xFFFF,
+		.step		= 1,
+		.def		= AR0130_AE_DCG_HIGH_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_AE_DCG_LOW,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "AE DCG Exposure Low",
+		.min		= 0,
+		.max		= 0xFFFF,
+		.step		= 1,
+		.def		= AR0130_AE_DCG_LOW_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_FRAME_RATE_MIN,
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.name		= "Min Frame Rate",
+		.min		= 1,
+		.max		= 60,
+		.step		= 1,
+		.def		= AR0130_AFR_FPS_MIN_DEF,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_HDR,
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.name		= "HDR Mode",
+		.min		= 0,
+		.max		= 1,
+		.step		= 1,
+		.def		= 0,
+	}, {
+		.ops		= &ar0130_ctrl_ops,
+		.id		= V4L2_CID_AR0130_HDR_RATIO,
+		.type		= V4L2_CTRL_TYPE_MENU,
+		.name		= "HDR Exposure Ratio",
+		.min		= 0,
+		.max		= ARRAY_SIZE(ar0130_hdr_ratio_menu) - 1,
+		.def		= AR0130_OP_MODE_RATIO_16X,
+		.qmenu		= ar0130_hdr_ratio_menu,
+	},
+};
+
+static int ar0130_init_controls(struct ar0130_priv *ar0130)
+{
+	v4l2_ctrl_handler_init(&ar0130->ctrls, 5 + ARRAY_SIZE(ar0130_ctrls));
+
+	ar0130->exposure_auto = v4l2_ctrl_new_std_menu(&ar0130->ctrls,
+				&ar0130_ctrl_ops, V4L2_CID_EXPOSURE_AUTO,
+				V4L2_EXPOSURE_MANUAL, 0, V4L2_EXPOSURE_AUTO);
+	ar0130->exposure = v4l2_ctrl_new_std(&ar0130->ctrls, &ar0130_ctrl_ops,
+				V4L2_CID_EXPOSURE, AR0130_EXPOSURE_MIN,
+				ar0130->frame_length - 1, 1,
+				AR0130_EXPOSURE_DEF);
+	ar0130->again = v4l2_ctrl_new_std(&ar0130->ctrls, &ar0130_ctrl_ops,
+				V4L2_CID_ANALOGUE_GAIN, 0,
+				AR0130_COLUMN_GAIN_MAX, 1, 0);
+	ar0130->gain = v4l2_ctrl_new_std(&ar0130->ctrls, &ar0130_ctrl_ops,
+				V4L2_CID_GAIN, 0, AR0130_GLOBAL_GAIN_MAX, 1,
+				AR0130_GLOBAL_GAIN_DEF);
+	ar0130->embedded = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[0], NULL);
+	ar0130->dropped = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[1], NULL);
+	ar0130->ae_algorithm = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[2], NULL);
+	ar0130->ae_target = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[3], NULL);
+	ar0130->ae_alpha = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[4], NULL);
+	ar0130->ae_max_exposure = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[5], NULL);
+	ar0130->ae_min_exposure = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[6], NULL);
+	ar0130->ae_dcg_high = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[7], NULL);
+	ar0130->ae_dcg_low = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[8], NULL);
+	ar0130->auto_priority = v4l2_ctrl_new_std(&ar0130->ctrls,
+				&ar0130_ctrl_ops, V4L2_CID_EXPOSURE_AUTO_PRIORITY,
+				0, 1, 1, 0);
+	ar0130->fps_min = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[9], NULL);
+	ar0130->hdr = v4l2_ctrl_new_custom(&ar0130->ctrls, &ar0130_ctrls[10],
+				NULL);
+	ar0130->hdr_ratio = v4l2_ctrl_new_custom(&ar0130->ctrls,
+				&ar0130_ctrls[11], NULL);
+
+	if (ar0130->ctrls.error) {
+		int ret = ar0130->ctrls.error;
+
+		v4l2_ctrl_handler_free(&ar0130->ctrls);
+		return ret;
+	}
+
+	v4l2_ctrl_auto_cluster(4, &ar0130->exposure_auto,
+				V4L2_EXPOSURE_MANUAL, true);
+	v4l2_ctrl_cluster(2, &ar0130->ae_max_exposure);
+	v4l2_ctrl_cluster(2, &ar0130->ae_dcg_high);
+	ar0130_update_exposure_range(ar0130);
+	ar0130->subdev.ctrl_handler = &ar0130->ctrls;
+
+	return 0;
+}
+
+/************************************************************************
+                        v4l2_subdev_core_ops
+************************************************************************/
+static int ar0130_g_chip_ident(struct v4l2_subdev *sd,
+				struct v4l2_dbg_chip_ident *id)
+{
+	id->ident    = V4L2_IDENT_AR0130;
+	id->revision = 1;
+	
+	return 0;
+}
+
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 static int ar0130_g_reg(struct v4l2_subdev *sd,
 				struct v4l2_dbg_register *reg)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
 	u16 data;
+	int ret;
+
+	mutex_lock(&ar0130->lock);
+	ret = ar0130_power_wait(ar0130);
+	if (ret == 0)
+		ret = ar0130_burst_read(client, reg->reg, &data, 1);
+	mutex_unlock(&ar0130->lock);
+	if (ret < 0)
+		return ret;
 
 	reg->size = 2;
-	data = ar0130_reg_read(client, reg->reg);
 
 	reg->val = (__u64)data;
 	return 0;
@@ -509,9 +2964,15 @@ static int ar0130_s_reg(struct v4l2_subdev *sd,
 				struct v4l2_dbg_register *reg)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
 	int ret;
 
-	ret = ar0130_reg_write(client, reg->reg, reg->val);
+	mutex_lock(&ar0130->lock);
+	ret = ar0130_power_wait(ar0130);
+	if (ret == 0)
+		ret = ar0130_reg_write(client, reg->reg, reg->val);
+	mutex_unlock(&ar0130->lock);
+
 	return ret;
 }
 #endif
@@ -521,71 +2982,280 @@ static int ar0130_s_power(struct v4l2_subdev *sd, int on)
 	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
 	int ret = 0;
 
-	mutex_lock(&ar0130->power_lock);
+	mutex_lock(&ar0130->lock);
 	
 	/*
 	* If the power count is modified from 0 to != 0 or from != 0 to 0,
 	* update the power state.
 	*/	
 	if (ar0130->power_count == !on) {
-		if (on) {
+		if (on && async_power) {
+			/* operations wait in ar0130_power_wait() */
+			INIT_COMPLETION(ar0130->power_done);
+			ar0130->power_error = 0;
+			schedule_work(&ar0130->power_work);
+		} else if (on) {
 			ret = ar0130_power_on(ar0130);
 			if (ret) {
 				dev_err(ar0130->subdev.v4l2_dev->dev,
 				"Failed to power on: %d\n", ret);
 				goto out;
 			}
-		} else 
+		} else {
+			cancel_work_sync(&ar0130->power_work);
+			complete_all(&ar0130->power_done);
+			ar0130->power_error = 0;
 			ret = ar0130_power_off(ar0130);
+		}
 	} 
 	/* Update the power count. */
 	ar0130->power_count += on ? 1 : -1;
 	WARN_ON(ar0130->power_count < 0);
 out:
-	mutex_unlock(&ar0130->power_lock);
+	mutex_unlock(&ar0130->lock);
 	return ret; 
 }
 
 /***************************************************
 		v4l2_subdev_video_ops	
 ****************************************************/
+/**
+ * ar0130_standby - stop streaming and keep the register contents
+ * @client: pointer to the i2c client
+ *
+ * The sensor finishes the current frame and enters soft standby, which
+ * retains every register, so the next stream start is a single write.
+ * With pdata->gate_xclk the input clock is stopped too once the sensor
+ * reports standby; the next register access restarts it.
+ */
+static int ar0130_standby(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
+	if (ret < 0)
+		return ret;
+
+	if (ar0130->pdata->gate_xclk && ar0130->pdata->set_xclk) {
+		ret = ar0130_poll_reg(client, AR0130_FRAME_STATUS,
+				AR0130_FRAME_STATUS_STANDBY,
+				AR0130_FRAME_STATUS_STANDBY,
+				AR0130_STANDBY_TIMEOUT);
+		if (ret < 0)
+			return ret;
+
+		ar0130->pdata->set_xclk(&ar0130->subdev, 0);
+		ar0130->xclk_gated = 1;
+	}
+
+	ar0130->stop_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	dev_dbg(&client->dev, "stream stop took %u us\n", ar0130->stop_us);
+
+	return 0;
+}
+
+/**
+ * ar0130_stream_on - bring the sensor up to streaming
+ * @client: pointer to the i2c client
+ *
+ * Called with ar0130->lock held; the controls are applied afterwards.
+ */
+static int ar0130_stream_on(struct i2c_client *client)
+{
+	struct ar0130_priv *ar0130 = to_ar0130(client);
+	unsigned int init_done = ar0130->init_done;
+	int ret;
+
+	ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * Stages still valid since the last reset are skipped; the mode only
+	 * gets the registers that differ from the one in the sensor.
+	 */
+	if (!(init_done & AR0130_INIT_SEQ) ||
+	    ar0130->op_mode != ar0130_operation_mode(ar0130)) {
+		ret = ar0130_sensor_mode_setup(client);
+		if(ret < 0){
+			dev_err(ar0130->subdev.v4l2_dev->dev, "Failed to setup sensor mode: %d\n", ret);
+			return ret;
+		}
+
+		ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
+		ret |= ar0130_reg_write(client, AR0130_HDR_COMP, AR0130_HDR_COMP_ENABLE);
+		ret |= ar0130_reg_write(client, AR0130_TEST_REG, AR0130_TEST_PATTERN);
+		ret |= ar0130_reg_write(client, AR0130_TEMPSENS_CTRL,
+					AR0130_TEMPSENS_POWER_ON);
+		if (ret < 0)
+			return ret;
+		ar0130->init_done |= AR0130_INIT_SEQ;
+	}
+
+	ret = ar0130_set_resolution(client);
+	if(ret < 0){
+		dev_err(ar0130->subdev.v4l2_dev->dev, "Failed to setup resolution: %d\n", ret);
+		return ret;
+	}
+
+	ret = ar0130_reg_write(client, AR0130_DATA_PEDESTAL,
+				ar0130->bus_format->pedestal);
+	ret |= ar0130_reg_write(client, AR0130_EMBEDDED_DATA_CTRL,
+				ar0130->embedded->cur.val ?
+				AR0130_EMBEDDED_DATA_DEF | AR0130_EMBEDDED_DATA |
+				AR0130_EMBEDDED_STATS_EN :
+				AR0130_EMBEDDED_DATA_DEF);
+	if (ret < 0)
+		return ret;
+
+	if (!(init_done & AR0130_INIT_PLL)) {
+		ret = ar0130_pll_enable(client);
+		if(ret < 0){
+			dev_err(ar0130->subdev.v4l2_dev->dev, "Failed to enable pll: %d\n", ret);
+			return ret;
+		}
+	}
+
+	ret = ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_ON);
+	if (ret < 0)
+		return ret;
+
+	if (!(init_done & AR0130_INIT_PLL)) {
+		ret = ar0130_wait_streaming(client);
+		if (ret < 0) {
+			dev_err(ar0130->subdev.v4l2_dev->dev, "Sensor failed to start: %d\n", ret);
+			return ret;
+		}
+		ar0130->init_done |= AR0130_INIT_PLL;
+	}
+
+	return 0;
+}
+
 static int ar0130_s_stream(struct v4l2_subdev *sd, int enable)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
 	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	unsigned int init_done;
+	ktime_t start = ktime_get();
 	int ret;
 
-	if (!enable) {
-		return 0;
+	/* the operating mode only changes in standby, on the next start */
+	v4l2_ctrl_grab(ar0130->hdr, enable);
+	v4l2_ctrl_grab(ar0130->hdr_ratio, enable);
+	/* the embedded rows are part of the frame size */
+	v4l2_ctrl_grab(ar0130->embedded, enable);
+
+	mutex_lock(&ar0130->lock);
+	init_done = ar0130->init_done;
+	ret = ar0130_power_wait(ar0130);
+	if (ret == 0 && !enable) {
+		/* a work item already running finds streaming cleared */
+		ar0130->streaming = 0;
+		cancel_delayed_work(&ar0130->frame_work);
+		cancel_delayed_work(&ar0130->ae_work);
+		ret = ar0130_standby(client);
+	} else if (ret == 0) {
+		ret = ar0130_stream_on(client);
 	}
-	
-	ret = ar0130_linear_mode_setup(client);
-	if(ret < 0){
-		dev_err(ar0130->subdev.v4l2_dev->dev, "Failed to setup linear mode: %d\n", ret);
+	mutex_unlock(&ar0130->lock);
+	if (ret < 0 || !enable)
 		return ret;
+
+	/* s_ctrl takes the lock for each control */
+	if (!(init_done & AR0130_INIT_CTRLS)) {
+		ret = v4l2_ctrl_handler_setup(&ar0130->ctrls);
+		if (ret < 0)
+			return ret;
 	}
 
-	ret = ar0130_set_resolution(client, ar0130->res_index);
-	if(ret < 0){
-		dev_err(ar0130->subdev.v4l2_dev->dev, "Failed to setup resolution: %d\n", ret);
-		return ret;
-	}
+	mutex_lock(&ar0130->lock);
+	ar0130->init_done |= AR0130_INIT_CTRLS;
+	spin_lock_irq(&ar0130->frame_lock);
+	memset(&ar0130->frames, 0, sizeof(ar0130->frames));
+	spin_unlock_irq(&ar0130->frame_lock);
+	ar0130->streaming = 1;
+	ar0130->ae_synced = 0;
+	schedule_delayed_work(&ar0130->frame_work, 0);
+	ar0130_ae_kick(ar0130);
+	mutex_unlock(&ar0130->lock);
+
+	ar0130->start_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	dev_dbg(&client->dev, "stream start took %u us (stages 0x%x resident)\n",
+		ar0130->start_us, init_done);
+	
+	return 0;
+}
+
+static int ar0130_g_frame_interval(struct v4l2_subdev *sd,
+				struct v4l2_subdev_frame_interval *fi)
+{
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+
+	if (fi->pad)
+		return -EINVAL;
+
+	ar0130_frame_interval(ar0130, ar0130_mode(ar0130->res_index),
+				ar0130_active_frame_length(ar0130),
+				&fi->interval);
+
+	return 0;
+}
+
+/**
+ * ar0130_s_frame_interval - set the frame interval
+ * @sd: pointer to the subdev
+ * @fi: requested interval, updated with the one the sensor runs at
+ *
+ * The interval is set by the frame length. While streaming, the new
+ * length and any exposure it clips are applied under grouped hold so
+ * they land on the same frame. The timing state and the registers change
+ * together under ar0130->lock, so the AE work never sees one without the
+ * other.
+ */
+static int ar0130_s_frame_interval(struct v4l2_subdev *sd,
+				struct v4l2_subdev_frame_interval *fi)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	int ret = 0;
+
+	if (fi->pad)
+		return -EINVAL;
+
+	mutex_lock(&ar0130->lock);
+	ar0130->interval = fi->interval;
+	ar0130_update_timing(ar0130);
 
-	ret |= ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_OFF);
-	ret |= ar0130_reg_write(client, 0x31D0, 0x0001);	// HDR_COMP
+	if (ar0130->power_count && ar0130->mode_count) {
+		ret = ar0130_power_wait(ar0130);
+		if (ret < 0)
+			goto out;
 
-	ret = ar0130_pll_enable(client);
-	if(ret < 0){
-		dev_err(ar0130->subdev.v4l2_dev->dev, "Failed to enable pll: %d\n", ret);
-		return ret;
-	}
+		ret = ar0130_group_hold(client, 1);
+		if (ret < 0)
+			goto out;
 
-	ret |= ar0130_reg_write(client, AR0130_RESET_REG, AR0130_STREAM_ON);
+		ret = ar0130_set_resolution(client);
+		if (!ar0130->autoexposure)
+			ret |= ar0130_reg_write(client, AR0130_COARSE_INT_TIME,
+					clamp_t(u32, ar0130->exposure->cur.val,
+					ar0130_min_exposure(ar0130),
+					ar0130->frame_length - 1));
+		ret |= ar0130_write_ae_tuning(ar0130, NULL);
+		ret |= ar0130_group_hold(client, 0);
+	}
 
-	ret |= ar0130_set_autoexposure(client, ENABLE);
+	ar0130_frame_interval(ar0130, ar0130_mode(ar0130->res_index),
+				ar0130->frame_length,
+				&fi->interval);
+out:
+	mutex_unlock(&ar0130->lock);
 
-	ret |= ar0130_reg_write(client, AR0130_TEST_REG, AR0130_TEST_PATTERN);
-	
+	/* clip the controls to what was written, under the handler lock */
+	ar0130_update_exposure_range(ar0130);
 	return ret;
 }
 
@@ -598,11 +3268,12 @@ static int ar0130_enum_mbus_code(struct v4l2_subdev *sd,
 {
 	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
 
-	if (code->pad || code->index)
+	if (code->pad || code->index >= ARRAY_SIZE(ar0130_formats))
 		return -EINVAL;
 	
-	code->code = ar0130->format.code;
-		return 0;
+	code->code = ar0130_bayer_code(&ar0130_formats[code->index],
+					&ar0130->crop);
+	return 0;
 }
 
 static int ar0130_enum_frame_size(struct v4l2_subdev *sd,
@@ -610,19 +3281,80 @@ static int ar0130_enum_frame_size(struct v4l2_subdev *sd,
 				struct v4l2_subdev_frame_size_enum *fse)
 {
 	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	const struct ar0130_mode *mode;
+	unsigned int rows = ar0130_embedded_rows(ar0130->embedded->cur.val);
 	
-	if (fse->index >= 8 || fse->code != ar0130->format.code)
+	if (fse->index >= ARRAY_SIZE(ar0130_modes) ||
+	    ar0130_find_format(fse->code) == NULL)
 		return -EINVAL;
 
-	fse->min_width = AR0130_WINDOW_WIDTH_DEF
-				/ min_t(unsigned int, 7, fse->index + 1);
-	fse->max_width = fse->min_width;
-	fse->min_height = AR0130_WINDOW_HEIGHT_DEF / (fse->index + 1);
-	fse->max_height = fse->min_height;
+	mode = &ar0130_modes[fse->index];
+	fse->min_width = mode->width;
+	fse->max_width = mode->width;
+	fse->min_height = mode->height + rows;
+	fse->max_height = mode->height + rows;
 
 	return 0;
 }
 
+/* common rates offered below the fastest one of a mode, in fps */
+static const unsigned int ar0130_frame_rates[] = {
+	60, 50, 30, 25, 20, 15, 10, 5,
+};
+
+static int ar0130_enum_frame_interval(struct v4l2_subdev *sd,
+				struct v4l2_subdev_fh *fh,
+				struct v4l2_subdev_frame_interval_enum *fie)
+{
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	const struct ar0130_mode *mode = NULL;
+	struct v4l2_fract fastest;
+	unsigned int i, index = fie->index;
+	unsigned int rows = ar0130_embedded_rows(ar0130->embedded->cur.val);
+
+	if (fie->pad || ar0130_find_format(fie->code) == NULL ||
+	    fie->height <= rows)
+		return -EINVAL;
+
+	if (fie->width == ar0130->format.width &&
+	    fie->height == ar0130->format.height) {
+		/* the active window, possibly an arbitrary crop */
+		mode = ar0130_mode(ar0130->res_index);
+		ar0130_frame_interval(ar0130, mode,
+			ar0130_min_frame_length(mode, ar0130->crop.height),
+			&fastest);
+	} else {
+		for (i = 0; i < ARRAY_SIZE(ar0130_modes); i++) {
+			if (ar0130_modes[i].width == fie->width &&
+			    ar0130_modes[i].height + rows == fie->height) {
+				mode = &ar0130_modes[i];
+				break;
+			}
+		}
+		if (mode == NULL)
+			return -EINVAL;
+		fastest = ar0130->mode_timing[i].min_interval;
+	}
+	if (index == 0) {
+		fie->interval = fastest;
+		return 0;
+	}
+
+	/* standard rates slower than the fastest one, in decreasing order */
+	for (i = 0; i < ARRAY_SIZE(ar0130_frame_rates); i++) {
+		if ((u64)ar0130_frame_rates[i] * fastest.numerator
+				>= fastest.denominator)
+			continue;
+		if (--index == 0) {
+			fie->interval.numerator = 1;
+			fie->interval.denominator = ar0130_frame_rates[i];
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
 static int ar0130_get_format(struct v4l2_subdev *sd,
 				struct v4l2_subdev_fh *fh,
 				struct v4l2_subdev_format *fmt)
@@ -635,36 +3367,211 @@ static int ar0130_get_format(struct v4l2_subdev *sd,
 	return 0;
 }
 
+/**
+ * ar0130_set_format - set the output size
+ * @sd: pointer to the subdev
+ * @fh: file handle for TRY formats
+ * @format: requested format, updated with the one applied
+ *
+ * A size that divides the crop rectangle by the scale of a mode reads it
+ * out with that mode's skipping and binning. Any other size picks a mode
+ * and window through ar0130_select_mode(). With embedded data enabled the
+ * height includes its rows.
+ */
 static int ar0130_set_format(struct v4l2_subdev *sd,
 				struct v4l2_subdev_fh *fh,
 				struct v4l2_subdev_format *format)
 {
 	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	struct v4l2_mbus_framefmt *fmt;
+	const struct ar0130_format *bus_format;
+	const struct ar0130_mode *mode;
 	struct ar0130_frame_size size;
+	struct v4l2_rect *crop;
+	enum resolution res_index;
+	unsigned int scale, rows;
+	int i, ret = 0;
+
+	fmt = __ar0130_get_pad_format(ar0130, fh, format->pad, format->which);
+	crop = __ar0130_get_pad_crop(ar0130, fh, format->pad, format->which);
+	if (fmt == NULL || crop == NULL)
+		return -EINVAL;
+
+	mutex_lock(&ar0130->lock);
+	/* the mode registers are only rebuilt on stream start */
+	if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE && ar0130->streaming) {
+		mutex_unlock(&ar0130->lock);
+		return -EBUSY;
+	}
+
+	rows		= ar0130_embedded_rows(ar0130->embedded->cur.val);
+	size.width	= format->format.width;
+	size.height 	= format->format.height > rows ?
+			  format->format.height - rows : 0;
+
+	bus_format = ar0130_find_format(format->format.code);
+	if (bus_format == NULL)
+		bus_format = &ar0130_formats[0];
+
+	/* the largest mode is unscaled, search from it downwards */
+	for (i = ARRAY_SIZE(ar0130_modes) - 1; i >= 0; i--) {
+		scale = ar0130_mode_scale(&ar0130_modes[i]);
+		if (size.width * scale == crop->width &&
+		    size.height * scale == crop->height)
+			break;
+	}
+
+	if (i >= 0) {
+		res_index = i;
+	} else {
+		res_index = ar0130_select_mode(ar0130, size.width,
+						size.height, crop);
+		scale = ar0130_mode_scale(&ar0130_modes[res_index]);
+
+		size.width	= crop->width / scale;
+		size.height	= crop->height / scale;
+	}
+
+	fmt->width	= size.width;
+	fmt->height	= size.height + rows;
+	fmt->code 	= ar0130_bayer_code(bus_format, crop);
+	fmt->field	= V4L2_FIELD_NONE;
+	fmt->colorspace	= V4L2_COLORSPACE_SRGB;
+	format->format	= *fmt;
 
-	size.height 	= format->format.height;
-	size.width 	= format->format.width;	
-	ar0130->res_index 		= ar0130_v4l2_try_fmt_cap(&size);
-	ar0130->crop.width		= size.width;
-	ar0130->crop.height		= size.height;
-	ar0130->curr_crop.width		= size.width;
-	ar0130->curr_crop.height	= size.height;
-	ar0130->format.width		= size.width;
-	ar0130->format.height		= size.height;
-	ar0130->format.code 		= V4L2_MBUS_FMT_SGRBG12_1X12;	
-
-	format->format.width		= size.width;
-	format->format.height		= size.height;
+	if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
+		ar0130->res_index	= res_index;
+		mode			= ar0130_mode(res_index);
+		ar0130->xskip		= mode->skip;
+		ar0130->yskip		= mode->skip;
+		ar0130->curr_crop	= *crop;
+		ar0130_update_timing(ar0130);
+
+		ret = ar0130_set_bus_format(ar0130, bus_format);
+		if (ret < 0) {
+			/* the host can't take it, keep the bus as it is */
+			fmt->code = ar0130_bayer_code(ar0130->bus_format, crop);
+			format->format.code = fmt->code;
+			ret = 0;
+		}
+	}
+	mutex_unlock(&ar0130->lock);
+
+	/* takes the control handler lock, which ranks above ours */
+	if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE)
+		ar0130_update_exposure_range(ar0130);
 	
+	return ret;
+}
+
+static int ar0130_get_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_fh *fh,
+				struct v4l2_subdev_selection *sel)
+{
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	struct v4l2_rect *crop;
+
+	switch (sel->target) {
+	case V4L2_SUBDEV_SEL_TGT_CROP_ACTUAL:
+		crop = __ar0130_get_pad_crop(ar0130, fh, sel->pad, sel->which);
+		if (crop == NULL)
+			return -EINVAL;
+		sel->r = *crop;
+		return 0;
+
+	case V4L2_SUBDEV_SEL_TGT_CROP_BOUNDS:
+		sel->r.left	= 0;
+		sel->r.top	= 0;
+		sel->r.width	= AR0130_PIXEL_ARRAY_WIDTH;
+		sel->r.height	= AR0130_PIXEL_ARRAY_HEIGHT;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * ar0130_set_selection - set the readout window
+ * @sd: pointer to the subdev
+ * @fh: file handle for TRY selections
+ * @sel: requested rectangle, updated with the one applied
+ *
+ * The window is programmed through X/Y_ADDR_START/END and keeps the
+ * current skipping and binning; the output format follows it. Even coordinates keep
+ * the Bayer order.
+ */
+static int ar0130_set_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_fh *fh,
+				struct v4l2_subdev_selection *sel)
+{
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	struct v4l2_mbus_framefmt *fmt;
+	struct v4l2_rect *crop;
+	struct v4l2_rect rect;
+	unsigned int scale, unit, min_width, min_height;
+
+	if (sel->target != V4L2_SUBDEV_SEL_TGT_CROP_ACTUAL)
+		return -EINVAL;
+
+	fmt = __ar0130_get_pad_format(ar0130, fh, sel->pad, sel->which);
+	crop = __ar0130_get_pad_crop(ar0130, fh, sel->pad, sel->which);
+	if (fmt == NULL || crop == NULL)
+		return -EINVAL;
+
+	mutex_lock(&ar0130->lock);
+	/* the mode registers are only rebuilt on stream start */
+	if (sel->which == V4L2_SUBDEV_FORMAT_ACTIVE && ar0130->streaming) {
+		mutex_unlock(&ar0130->lock);
+		return -EBUSY;
+	}
+
+	scale = clamp_t(unsigned int, crop->width / fmt->width, 1, 8);
+
+	/* sizes are whole Bayer quads of the output, at least the minimum */
+	unit		= 2 * scale;
+	min_width	= roundup(AR0130_CROP_WIDTH_MIN * scale, unit);
+	min_height	= roundup(AR0130_CROP_HEIGHT_MIN * scale, unit);
+
+	/* leave room for the smallest window before sizing it */
+	rect.left	= clamp_t(s32, ALIGN(sel->r.left, 2), 0,
+				AR0130_PIXEL_ARRAY_WIDTH - min_width);
+	rect.top	= clamp_t(s32, ALIGN(sel->r.top, 2), 0,
+				AR0130_PIXEL_ARRAY_HEIGHT - min_height);
+	rect.width	= clamp_t(u32, roundup(min_t(u32, sel->r.width,
+				AR0130_PIXEL_ARRAY_WIDTH), unit), min_width,
+				AR0130_PIXEL_ARRAY_WIDTH - rect.left);
+	rect.height	= clamp_t(u32, roundup(min_t(u32, sel->r.height,
+				AR0130_PIXEL_ARRAY_HEIGHT), unit), min_height,
+				AR0130_PIXEL_ARRAY_HEIGHT - rect.top);
+	rect.width	= rounddown(rect.width, unit);
+	rect.height	= rounddown(rect.height, unit);
+
+	*crop		= rect;
+	fmt->width	= rect.width / scale;
+	fmt->height	= rect.height / scale +
+			  ar0130_embedded_rows(ar0130->embedded->cur.val);
+	fmt->code	= ar0130_bayer_code(ar0130_find_format(fmt->code) ? :
+						&ar0130_formats[0], &rect);
+	sel->r		= rect;
+
+	if (sel->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
+		ar0130->curr_crop = rect;
+		ar0130_update_timing(ar0130);
+	}
+	mutex_unlock(&ar0130->lock);
+
+	/* takes the control handler lock, which ranks above ours */
+	if (sel->which == V4L2_SUBDEV_FORMAT_ACTIVE)
+		ar0130_update_exposure_range(ar0130);
+
 	return 0;
 }
 
 static int ar0130_g_crop(struct v4l2_subdev *sd, struct v4l2_crop *a)
 {
-	a->c.left	= 0;
-	a->c.top	= 0;
-	a->c.width	= VGA_WIDTH;
-	a->c.height	= VGA_HEIGHT;
+	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+
+	a->c		= ar0130->crop;
 	a->type		= V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 	return 0;
@@ -672,22 +3579,17 @@ static int ar0130_g_crop(struct v4l2_subdev *sd, struct v4l2_crop *a)
 
 static int ar0130_s_crop(struct v4l2_subdev *sd, struct v4l2_crop *a)
 {
-	struct v4l2_rect *rect = &a->c;
-	struct ar0130_frame_size size;
-	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
+	struct v4l2_subdev_selection sel = {
+		.which	= V4L2_SUBDEV_FORMAT_ACTIVE,
+		.target	= V4L2_SUBDEV_SEL_TGT_CROP_ACTUAL,
+		.r	= a->c,
+	};
+	int ret;
 
-	size.height = rect->height;
-	size.width = rect->width;	
-	ar0130_v4l2_try_fmt_cap(&size);
-	ar0130->crop.width		= size.width;
-	ar0130->crop.height		= size.height;
-	ar0130->curr_crop.width		= size.width;
-	ar0130->curr_crop.height	= size.height;
-	ar0130->format.width		= size.width;
-	ar0130->format.height		= size.height;
-	ar0130->format.code 		= V4L2_MBUS_FMT_SGRBG12_1X12;	
-	
-	return 0;
+	ret = ar0130_set_selection(sd, NULL, &sel);
+	a->c = sel.r;
+
+	return ret;
 }
 
 /***********************************************************
@@ -697,6 +3599,7 @@ static int ar0130_registered(struct v4l2_subdev *sd)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
 	struct ar0130_priv *ar0130 = to_ar0130(client);
+	ktime_t start = ktime_get();
 	s32 data;
 	int ret;
 
@@ -708,14 +3611,24 @@ static int ar0130_registered(struct v4l2_subdev *sd)
 
 	/* Read out the chip version register */
 	data = ar0130_reg_read(client, 0x3000);
+
+	/* the bus can't be re-clocked from here, only hint at the cause */
+	if (data != AR0130_CHIP_ID && ar0130->i2c_khz > AR0130_I2C_STD_KHZ)
+		dev_err(&client->dev, "chip ID read failed at %u kHz, "
+			"try an i2c_speed of %u\n", ar0130->i2c_khz,
+			AR0130_I2C_STD_KHZ);
+
 	if (data != AR0130_CHIP_ID) {
 		dev_err(&client->dev, "AR0130 not detected, wrong chip ID "
 					"0x%4.4X\n", data);
+		ar0130_power_off(ar0130);
 		return -ENODEV;
 	}
 
 	dev_info(&client->dev, "AR0130 detected at address 0x%02X: chip ID = 0x%4.4X\n",
 			client->addr, AR0130_CHIP_ID);
+	dev_info(&client->dev, "i2c bus at %u kHz, detection took %lld us\n",
+			ar0130->i2c_khz, ktime_to_us(ktime_sub(ktime_get(), start)));
 			
 	ret = ar0130_power_off(ar0130);
 
@@ -727,6 +3640,13 @@ static int ar0130_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	struct ar0130_priv *ar0130 = container_of(sd, struct ar0130_priv, subdev);
 	int ret = 0;
     
+	/* another user, possibly a running stream, keeps its mode */
+	mutex_lock(&ar0130->lock);
+	if (ar0130->power_count || ar0130->streaming) {
+		mutex_unlock(&ar0130->lock);
+		return ar0130_s_power(sd, 1);
+	}
+
 	ar0130->crop.width     = AR0130_WINDOW_WIDTH_DEF;
 	ar0130->crop.height    = AR0130_WINDOW_HEIGHT_DEF;
 	ar0130->crop.left      = AR0130_COLUMN_START_DEF;
@@ -734,9 +3654,19 @@ static int ar0130_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	
 	ar0130->format.code 		= V4L2_MBUS_FMT_SGRBG12_1X12;
 	ar0130->format.width 		= AR0130_WINDOW_WIDTH_DEF;
-	ar0130->format.height 		= AR0130_WINDOW_HEIGHT_DEF;
+	ar0130->format.height 		= AR0130_WINDOW_HEIGHT_DEF +
+				ar0130_embedded_rows(ar0130->embedded->cur.val);
 	ar0130->format.field 		= V4L2_FIELD_NONE;
 	ar0130->format.colorspace 	= V4L2_COLORSPACE_SRGB;
+	ar0130_set_bus_format(ar0130, &ar0130_formats[0]);
+	ar0130->curr_crop		= ar0130->crop;
+	ar0130->res_index		= AR0130_FULL_RES_45FPS;
+	ar0130->xskip			= 1;
+	ar0130->yskip			= 1;
+	ar0130_update_timing(ar0130);
+	mutex_unlock(&ar0130->lock);
+
+	ar0130_update_exposure_range(ar0130);
     
 	ret = ar0130_s_power(sd, 1);
 	return ret;
@@ -755,8 +3685,13 @@ static int ar0130_close(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 ****************************************************/
 static struct v4l2_subdev_core_ops ar0130_subdev_core_ops = {
 	.g_chip_ident	= ar0130_g_chip_ident,
-	.g_ctrl		= ar0130_g_ctrl,
-	.s_ctrl		= ar0130_s_ctrl,
+	.queryctrl	= v4l2_subdev_queryctrl,
+	.querymenu	= v4l2_subdev_querymenu,
+	.g_ctrl		= v4l2_subdev_g_ctrl,
+	.s_ctrl		= v4l2_subdev_s_ctrl,
+	.g_ext_ctrls	= v4l2_subdev_g_ext_ctrls,
+	.s_ext_ctrls	= v4l2_subdev_s_ext_ctrls,
+	.try_ext_ctrls	= v4l2_subdev_try_ext_ctrls,
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 	.g_register	= ar0130_g_reg,
 	.s_register	= ar0130_s_reg,
@@ -768,13 +3703,18 @@ static struct v4l2_subdev_video_ops ar0130_subdev_video_ops = {
 	.s_stream 	= ar0130_s_stream,
 	.g_crop		= ar0130_g_crop,
 	.s_crop		= ar0130_s_crop,
+	.g_frame_interval = ar0130_g_frame_interval,
+	.s_frame_interval = ar0130_s_frame_interval,
 };
 
 static struct v4l2_subdev_pad_ops ar0130_subdev_pad_ops = {
 	.enum_mbus_code	 = ar0130_enum_mbus_code,
 	.enum_frame_size = ar0130_enum_frame_size,
+	.enum_frame_interval = ar0130_enum_frame_interval,
 	.get_fmt  	 = ar0130_get_format,
 	.set_fmt 	 = ar0130_set_format,
+	.get_selection	 = ar0130_get_selection,
+	.set_selection	 = ar0130_set_selection,
 };
 
 static struct v4l2_subdev_ops ar0130_subdev_ops = {
@@ -793,6 +3733,401 @@ static const struct v4l2_subdev_internal_ops ar0130_subdev_internal_ops = {
 	.close		= ar0130_close,
 };
 
+/***************************************************
+		embedded data
+****************************************************/
+/* SMIA style tags, each followed by one data byte */
+#define AR0130_META_TAG_START		0x0A
+#define AR0130_META_TAG_ADDR_MSB	0xAA
+#define AR0130_META_TAG_ADDR_LSB	0xA5
+#define AR0130_META_TAG_DATA		0x5A
+#define AR0130_META_TAG_NULL		0x55
+#define AR0130_META_TAG_END		0x07
+
+/**
+ * ar0130_meta_byte - data byte carried by an embedded data pixel
+ * @row: start of the row
+ * @i: pixel index
+ * @bpp: bits per pixel of the bus format
+ *
+ * The sensor puts each byte in the 8 MSBs of a 12-bit pixel, so it
+ * survives the 10 and 8 bit bus formats. Pixels wider than 8 bits are
+ * stored in 16-bit words.
+ */
+static u8 ar0130_meta_byte(const void *row, unsigned int i, unsigned int bpp)
+{
+	if (bpp == 8)
+		return ((const u8 *)row)[i];
+
+	return ((const u16 *)row)[i] >> (bpp - 8);
+}
+
+static u16 *ar0130_meta_field(struct ar0130_frame_meta *meta, u16 reg)
+{
+	switch (reg) {
+	case AR0130_FRAME_COUNT:
+		meta->valid |= AR0130_META_FRAME_COUNT;
+		return &meta->frame_count;
+	case AR0130_FRAME_LENGTH:
+		meta->valid |= AR0130_META_FRAME_LENGTH;
+		return &meta->frame_length;
+	case AR0130_COARSE_INT_TIME:
+		meta->valid |= AR0130_META_INTEGRATION;
+		return &meta->integration;
+	case AR0130_GLOBAL_GAIN:
+		meta->valid |= AR0130_META_GLOBAL_GAIN;
+		return &meta->global_gain;
+	case AR0130_DIGITAL_TEST:
+		meta->valid |= AR0130_META_COLUMN_GAIN;
+		return &meta->digital_test;
+	}
+
+	return NULL;
+}
+
+/**
+ * ar0130_parse_row - decode one tagged embedded data row
+ * @row: start of the row
+ * @width: pixels in the row
+ * @bpp: bits per pixel of the bus format
+ * @meta: filled with the registers found
+ * @stats: byte count of a statistics row, NULL for a register row
+ *
+ * Register rows carry big endian register values at auto-incremented
+ * byte addresses; statistics rows are collected in order.
+ */
+static int ar0130_parse_row(const void *row, unsigned int width,
+				unsigned int bpp, struct ar0130_frame_meta *meta,
+				unsigned int *stats)
+{
+	unsigned int i;
+	u16 addr = 0, *field;
+	u8 val;
+
+	if (ar0130_meta_byte(row, 0, bpp) != AR0130_META_TAG_START)
+		return -EINVAL;
+
+	for (i = 1; i + 1 < width; i += 2) {
+		val = ar0130_meta_byte(row, i + 1, bpp);
+
+		switch (ar0130_meta_byte(row, i, bpp)) {
+		case AR0130_META_TAG_ADDR_MSB:
+			addr = (addr & 0x00FF) | (val << 8);
+			break;
+		case AR0130_META_TAG_ADDR_LSB:
+			addr = (addr & 0xFF00) | val;
+			break;
+		case AR0130_META_TAG_DATA:
+			if (stats) {
+				if (*stats < 2 * AR0130_META_STATS_MAX)
+					meta->stats[*stats / 2] |=
+						val << (*stats & 1 ? 0 : 8);
+				(*stats)++;
+			} else {
+				field = ar0130_meta_field(meta, addr & ~1);
+				if (field)
+					*field |= val << (addr & 1 ? 0 : 8);
+			}
+			addr++;
+			break;
+		case AR0130_META_TAG_NULL:
+			break;
+		case AR0130_META_TAG_END:
+			return 0;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ar0130_parse_frame_meta - decode the embedded data of a captured frame
+ * @frame: start of the frame buffer
+ * @bytesperline: stride of the buffer
+ * @width: pixels per row
+ * @height: rows in the frame, embedded rows included
+ * @bpp: bits per pixel of the bus format
+ * @meta: filled with the frame's metadata
+ *
+ * For frames captured with the "Embedded Data" control set: the frame
+ * counter, integration time and gains from the register rows, and the
+ * statistics rows as 16-bit words. Fields not present in the rows are
+ * left out of @meta->valid.
+ */
+int ar0130_parse_frame_meta(const void *frame, unsigned int bytesperline,
+				unsigned int width, unsigned int height,
+				unsigned int bpp, struct ar0130_frame_meta *meta)
+{
+	const u8 *buf = frame;
+	unsigned int i, stats = 0;
+	int ret = 0;
+
+	if (bpp < 8 || bpp > 12 || width < 2 ||
+	    height <= AR0130_EMBEDDED_DATA_ROWS + AR0130_EMBEDDED_STATS_ROWS)
+		return -EINVAL;
+
+	memset(meta, 0, sizeof(*meta));
+
+	for (i = 0; i < AR0130_EMBEDDED_DATA_ROWS && !ret; i++)
+		ret = ar0130_parse_row(buf + i * bytesperline, width, bpp,
+					meta, NULL);
+	for (i = height - AR0130_EMBEDDED_STATS_ROWS; i < height && !ret; i++)
+		ret = ar0130_parse_row(buf + i * bytesperline, width, bpp,
+					meta, &stats);
+
+	meta->num_stats = min_t(unsigned int, DIV_ROUND_UP(stats, 2),
+				AR0130_META_STATS_MAX);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ar0130_parse_frame_meta);
+
+/***************************************************
+		debugfs
+****************************************************/
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *ar0130_debugfs_root;
+
+static int ar0130_stats_show(struct seq_file *s, void *unused)
+{
+	struct ar0130_priv *ar0130 = s->private;
+
+	seq_printf(s, "pix_clk:\t%u\n", ar0130->pll.pix_clk);
+	seq_printf(s, "i2c_khz:\t%u\n", ar0130->i2c_khz);
+	seq_printf(s, "i2c_transfers:\t%u\n", ar0130->i2c_xfers);
+	seq_printf(s, "i2c_bytes:\t%u\n", ar0130->i2c_bytes);
+	seq_printf(s, "i2c_bus_us:\t%lu\n", ar0130->i2c_bus_us);
+	seq_printf(s, "cache_hits:\t%u\n", ar0130->cache_hits);
+	seq_printf(s, "cache_misses:\t%u\n", ar0130->cache_misses);
+	seq_printf(s, "stream_off_writes:\t%u\n", ar0130->stream_offs);
+	seq_printf(s, "settle_us:\t%u\n", ar0130->settle_us);
+	seq_printf(s, "pll_lock_us:\t%u\n", ar0130->pll_lock_us);
+	seq_printf(s, "stream_stop_us:\t%u\n", ar0130->stop_us);
+	seq_printf(s, "stream_start_us:\t%u\n", ar0130->start_us);
+
+	return 0;
+}
+
+static int ar0130_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ar0130_stats_show, inode->i_private);
+}
+
+static const struct file_operations ar0130_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ar0130_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int ar0130_status_show(struct seq_file *s, void *unused)
+{
+	struct ar0130_priv *ar0130 = s->private;
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+	struct ar0130_status status;
+	int ret = -ENODEV;
+
+	mutex_lock(&ar0130->lock);
+	if (ar0130->power_count && !ar0130_power_wait(ar0130))
+		ret = ar0130_read_status(client, &status);
+	mutex_unlock(&ar0130->lock);
+	if (ret < 0)
+		return ret;
+
+	seq_printf(s, "frame_count:\t%u\n", status.frame_count);
+	seq_printf(s, "frame_status:\t0x%04x\n", status.frame_status);
+	seq_printf(s, "integration:\t%u\n", status.integration);
+	seq_printf(s, "global_gain:\t0x%04x\n", status.global_gain);
+	seq_printf(s, "digital_test:\t0x%04x\n", status.digital_test);
+	seq_printf(s, "temperature:\t%u\n", status.temperature);
+
+	return 0;
+}
+
+static int ar0130_status_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ar0130_status_show, inode->i_private);
+}
+
+static const struct file_operations ar0130_status_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ar0130_status_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int ar0130_frames_show(struct seq_file *s, void *unused)
+{
+	struct ar0130_priv *ar0130 = s->private;
+	struct ar0130_frame_stats fs;
+
+	spin_lock_irq(&ar0130->frame_lock);
+	fs = ar0130->frames;
+	spin_unlock_irq(&ar0130->frame_lock);
+
+	seq_printf(s, "produced:\t%u\n", fs.produced);
+	seq_printf(s, "delivered:\t%u\n", fs.delivered);
+	seq_printf(s, "dropped:\t%u\n", fs.dropped);
+	seq_printf(s, "late:\t%u\n", fs.late);
+	seq_printf(s, "counter_samples:\t%u\n", fs.samples);
+	seq_printf(s, "jitter_max_ns:\t%u\n", fs.jitter_max_ns);
+	seq_printf(s, "jitter_mean_ns:\t%llu\n", fs.intervals ?
+			div_u64(fs.jitter_sum_ns, fs.intervals) : 0);
+
+	return 0;
+}
+
+static int ar0130_frames_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ar0130_frames_show, inode->i_private);
+}
+
+static const struct file_operations ar0130_frames_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ar0130_frames_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int ar0130_ae_show(struct seq_file *s, void *unused)
+{
+	struct ar0130_priv *ar0130 = s->private;
+	struct ar0130_sw_ae *ae = &ar0130->ae;
+
+	mutex_lock(&ar0130->lock);
+	seq_printf(s, "enabled:\t%d\n", ae->enabled);
+	seq_printf(s, "target:\t%u\n", ar0130->ae_target->cur.val);
+	seq_printf(s, "mean:\t%u\n", ae->mean);
+	seq_printf(s, "integration:\t%u\n", ae->integration);
+	seq_printf(s, "global_gain:\t0x%04x\n", ae->gain);
+	seq_printf(s, "column_gain:\t%ux\n", 1 << ae->column);
+	seq_printf(s, "iterations:\t%u\n", ae->iterations);
+	seq_printf(s, "sim_gain:\t%u\n", ae->sim_gain);
+	seq_printf(s, "step_pending:\t%d\n", ae->step_pending);
+	seq_printf(s, "converge_frames:\t%u\n", ae->converge_frames);
+	seq_printf(s, "converge_us:\t%u\n", ae->converge_us);
+	mutex_unlock(&ar0130->lock);
+
+	return 0;
+}
+
+static int ar0130_ae_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ar0130_ae_show, inode->i_private);
+}
+
+static const struct file_operations ar0130_ae_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ar0130_ae_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int ar0130_ae_step_get(void *data, u64 *val)
+{
+	struct ar0130_priv *ar0130 = data;
+
+	*val = ar0130->ae.sim_gain;
+	return 0;
+}
+
+/*
+ * Scales the measured mean as if the scene luminance changed by
+ * val / 256 and times the software AE until it settles again.
+ */
+static int ar0130_ae_step_set(void *data, u64 val)
+{
+	struct ar0130_priv *ar0130 = data;
+	struct ar0130_sw_ae *ae = &ar0130->ae;
+
+	if (val == 0 || val > 64 * AR0130_AE_SIM_UNITY)
+		return -EINVAL;
+
+	mutex_lock(&ar0130->lock);
+	ae->sim_gain		= val;
+	ae->step_pending	= 1;
+	ae->step_frames		= 0;
+	ae->stable		= 0;
+	ae->step_start		= ktime_get();
+	mutex_unlock(&ar0130->lock);
+
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(ar0130_ae_step_fops, ar0130_ae_step_get,
+			ar0130_ae_step_set, "%llu\n");
+
+static int ar0130_modes_show(struct seq_file *s, void *unused)
+{
+	struct ar0130_priv *ar0130 = s->private;
+	unsigned int i;
+
+	seq_printf(s, "size\tbin\tskip\tline_ns\tframe_us\tpixel_rate\n");
+	for (i = 0; i < ARRAY_SIZE(ar0130_modes); i++) {
+		const struct ar0130_mode *mode = &ar0130_modes[i];
+		const struct ar0130_mode_timing *t = &ar0130->mode_timing[i];
+
+		seq_printf(s, "%ux%u\t%u\t%u\t%u\t%u\t%u\n", mode->width,
+			mode->height, mode->bin, mode->skip, t->line_ns,
+			t->frame_us, t->pixel_rate);
+	}
+
+	return 0;
+}
+
+static int ar0130_modes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ar0130_modes_show, inode->i_private);
+}
+
+static const struct file_operations ar0130_modes_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ar0130_modes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void ar0130_debugfs_init(struct ar0130_priv *ar0130)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&ar0130->subdev);
+
+	if (IS_ERR_OR_NULL(ar0130_debugfs_root))
+		return;
+
+	ar0130->debugfs = debugfs_create_dir(dev_name(&client->dev),
+					ar0130_debugfs_root);
+	if (IS_ERR_OR_NULL(ar0130->debugfs))
+		return;
+
+	debugfs_create_file("stats", S_IRUGO, ar0130->debugfs, ar0130,
+			&ar0130_stats_fops);
+	debugfs_create_file("status", S_IRUGO, ar0130->debugfs, ar0130,
+			&ar0130_status_fops);
+	debugfs_create_file("modes", S_IRUGO, ar0130->debugfs, ar0130,
+			&ar0130_modes_fops);
+	debugfs_create_file("frames", S_IRUGO, ar0130->debugfs, ar0130,
+			&ar0130_frames_fops);
+	debugfs_create_file("ae", S_IRUGO, ar0130->debugfs, ar0130,
+			&ar0130_ae_fops);
+	debugfs_create_file("ae_step", S_IRUGO | S_IWUSR, ar0130->debugfs,
+			ar0130, &ar0130_ae_step_fops);
+}
+
+static void ar0130_debugfs_cleanup(struct ar0130_priv *ar0130)
+{
+	debugfs_remove_recursive(ar0130->debugfs);
+}
+#else
+static inline void ar0130_debugfs_init(struct ar0130_priv *ar0130) { }
+static inline void ar0130_debugfs_cleanup(struct ar0130_priv *ar0130) { }
+#endif
+
 /***************************************************
 		I2C driver
 ****************************************************/
@@ -820,8 +4155,24 @@ static int ar0130_probe(struct i2c_client *client,
 		return -ENOMEM;
 
 	ar0130->pdata = pdata;
+	ar0130->i2c_khz = pdata->i2c_speed ? pdata->i2c_speed : AR0130_I2C_STD_KHZ;
+
+	ret = ar0130_pll_setup(client, ar0130);
+	if (ret < 0) {
+		kfree(ar0130);
+		return ret;
+	}
+	ar0130_init_modes(ar0130);
 	
-	mutex_init(&ar0130->power_lock);
+	mutex_init(&ar0130->lock);
+	INIT_WORK(&ar0130->power_work, ar0130_power_work);
+	INIT_DELAYED_WORK(&ar0130->frame_work, ar0130_frame_work);
+	spin_lock_init(&ar0130->frame_lock);
+	INIT_DELAYED_WORK(&ar0130->ae_work, ar0130_ae_work);
+	ar0130->ae.sim_gain = AR0130_AE_SIM_UNITY;
+	ar0130->afr_fps_min = AR0130_AFR_FPS_MIN_DEF;
+	init_completion(&ar0130->power_done);
+	complete_all(&ar0130->power_done);
 	v4l2_i2c_subdev_init(&ar0130->subdev, client, &ar0130_subdev_ops);
 	ar0130->subdev.internal_ops = &ar0130_subdev_internal_ops;
 
@@ -842,6 +4193,17 @@ static int ar0130_probe(struct i2c_client *client,
 	ar0130->format.height 		= AR0130_WINDOW_HEIGHT_DEF;
 	ar0130->format.field 		= V4L2_FIELD_NONE;
 	ar0130->format.colorspace	= V4L2_COLORSPACE_SRGB;
+	ar0130->bus_format		= &ar0130_formats[0];
+	ar0130->res_index		= AR0130_FULL_RES_45FPS;
+	ar0130->xskip			= 1;
+	ar0130->yskip			= 1;
+	ar0130_update_timing(ar0130);
+
+	ret = ar0130_init_controls(ar0130);
+	if (ret < 0)
+		goto done;
+
+	ar0130_debugfs_init(ar0130);
 
 done:
 	if (ret < 0) {
@@ -859,8 +4221,15 @@ static int ar0130_remove(struct i2c_client *client)
 	struct ar0130_priv *ar0130 = to_ar0130(client);
 	struct v4l2_subdev *subdev = i2c_get_clientdata(client);
 
+	ar0130_debugfs_cleanup(ar0130);
+	cancel_work_sync(&ar0130->power_work);
+	cancel_delayed_work_sync(&ar0130->frame_work);
+	cancel_delayed_work_sync(&ar0130->ae_work);
 	v4l2_device_unregister_subdev(subdev);
+	v4l2_ctrl_handler_free(&ar0130->ctrls);
 	media_entity_cleanup(&ar0130->subdev.entity);
+	kfree(ar0130->hdr_seq);
+	kfree(ar0130->hdr_regs);
 	kfree(ar0130);
 	return 0;
 }
@@ -885,12 +4254,25 @@ static struct i2c_driver ar0130_i2c_driver = {
 ***************************************************/
 static int __init ar0130_module_init(void)
 {
-	return i2c_add_driver(&ar0130_i2c_driver);
+	int ret;
+
+#ifdef CONFIG_DEBUG_FS
+	ar0130_debugfs_root = debugfs_create_dir("ar0130", NULL);
+#endif
+	ret = i2c_add_driver(&ar0130_i2c_driver);
+#ifdef CONFIG_DEBUG_FS
+	if (ret)
+		debugfs_remove_recursive(ar0130_debugfs_root);
+#endif
+	return ret;
 }
 
 static void __exit ar0130_module_exit(void)
 {
 	i2c_del_driver(&ar0130_i2c_driver);
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(ar0130_debugfs_root);
+#endif
 }
 module_init(ar0130_module_init);
 module_exit(ar0130_module_exit);
@@ -5,6 +5,8 @@
 #define AR0130_I2C_ADDR		0x10 //(0x20 >> 1)
 //#define AR0130_I2C_ADDR	0x18 //(0x30 >> 1)
 
+#include <linux/types.h>
+
 struct v4l2_subdev;
 
 enum {
@@ -16,12 +18,52 @@ struct ar0130_platform_data {
 	int (*set_xclk)(struct v4l2_subdev *subdev, int hz);
 	int (*reset)(struct v4l2_subdev *subdev, int active);
 	int ext_freq; /* input frequency to the ar0130 for PLL dividers */
-	int target_freq; /* frequency target for the PLL */
+	int target_freq; /* highest pixel clock wanted, 0 for the sensor limit */
+	int isp_max_freq; /* highest pixel clock the host accepts, 0 if unlimited */
 	int version;
+	unsigned int i2c_max_len; /* max bytes per I2C message, 0 if unlimited */
+	int i2c_speed; /* camera bus clock in kHz, 0 for 100 kHz */
+	/* optional: set up the host bus for 12, 10 or 8 bit pixels */
+	int (*set_bus_format)(struct v4l2_subdev *subdev, unsigned int bpp);
 	unsigned int clk_pol:1;
+	unsigned int gate_xclk:1; /* stop XCLK while the stream is off */
 	void (*set_clock)(struct v4l2_subdev *subdev, unsigned int rate);
 };
 
+/* embedded data rows, enabled with the "Embedded Data" control */
+#define AR0130_EMBEDDED_DATA_ROWS	2	/* register values, above the image */
+#define AR0130_EMBEDDED_STATS_ROWS	2	/* statistics, below the image */
+#define AR0130_META_STATS_MAX		64
+
+/* ar0130_frame_meta.valid */
+#define AR0130_META_FRAME_COUNT		(1 << 0)
+#define AR0130_META_FRAME_LENGTH	(1 << 1)
+#define AR0130_META_INTEGRATION		(1 << 2)
+#define AR0130_META_GLOBAL_GAIN		(1 << 3)
+#define AR0130_META_COLUMN_GAIN		(1 << 4)
+
+struct ar0130_frame_meta {
+	unsigned int valid;	/* AR0130_META_* fields found in the rows */
+	u16 frame_count;	/* FRAME_COUNT */
+	u16 frame_length;	/* FRAME_LENGTH_LINES */
+	u16 integration;	/* COARSE_INTEGRATION_TIME, in lines */
+	u16 global_gain;	/* GLOBAL_GAIN, xxx.yyyyy */
+	u16 digital_test;	/* DIGITAL_TEST, column gain in bits 5:4 */
+	unsigned int num_stats;
+	u16 stats[AR0130_META_STATS_MAX];	/* statistics rows, in order */
+};
+
+int ar0130_parse_frame_meta(const void *frame, unsigned int bytesperline,
+				unsigned int width, unsigned int height,
+				unsigned int bpp, struct ar0130_frame_meta *meta);
+
+/*
+ * capture side: report each delivered frame, meta may be NULL. No caller
+ * in this tree; without one the dropped frame count stays 0.
+ */
+void ar0130_frame_done(struct v4l2_subdev *sd,
+			const struct ar0130_frame_meta *meta);
+
 /*
 struct AR0130_platform_data {
 	unsigned int clk_pol:1;
@@ -1,5 +1,10 @@
+struct ar0130_reg {
+	u16 addr;
+	u16 val;
+};
+
 
-static unsigned int ar0130_linear_data[79] = {
+static const u16 ar0130_linear_data[] = {
 0x0225,
 0x5050,
 0x2D26,
@@ -80,3 +85,105 @@ static unsigned int ar0130_linear_data[79] = {
 0x2C2C,
 0x2C2C
 };
+
+
+/*
+ * Per-mode register tables. Keep runs of consecutive addresses together,
+ * ar0130_write_regs() sends each run as one burst. A mode change only
+ * writes the delta, so every table lists the same registers; a register
+ * one mode changes is set back to its default by the others.
+ */
+/*
+ * Skipping reads one pixel pair out of every X/Y_ODD_INC + 1 columns and
+ * rows (3: 2x, 7: 4x), combined here with 2x2 digital binning.
+ */
+static const struct ar0130_reg ar0130_160x120_skip_binned_regs[] = {
+	{ 0x3032, 0x0002 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x03C1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x010E },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0007 },	// X_ODD_INC
+	{ 0x30A6, 0x0007 },	// Y_ODD_INC
+	{ 0x306E, 0x9010 },	// DATAPATH_SELECT
+};
+
+static const struct ar0130_reg ar0130_320x180_skip_binned_regs[] = {
+	{ 0x3032, 0x0002 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x02D1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x0186 },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0003 },	// X_ODD_INC
+	{ 0x30A6, 0x0003 },	// Y_ODD_INC
+	{ 0x306E, 0x9010 },	// DATAPATH_SELECT
+};
+
+static const struct ar0130_reg ar0130_320x240_skip_binned_regs[] = {
+	{ 0x3032, 0x0002 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x03C1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x01FE },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0003 },	// X_ODD_INC
+	{ 0x30A6, 0x0003 },	// Y_ODD_INC
+	{ 0x306E, 0x9010 },	// DATAPATH_SELECT
+};
+
+static const struct ar0130_reg ar0130_full_res_45fps_regs[] = {	// 1280x960
+	{ 0x3032, 0x0000 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x03C1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x03DE },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0001 },	// X_ODD_INC
+	{ 0x30A6, 0x0001 },	// Y_ODD_INC
+	{ 0x306E, 0x9000 },	// DATAPATH_SELECT, reset default
+};
+
+static const struct ar0130_reg ar0130_720p_60fps_regs[] = {	// 1280x720
+	{ 0x3032, 0x0000 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x02D1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x02EF },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0001 },	// X_ODD_INC
+	{ 0x30A6, 0x0001 },	// Y_ODD_INC
+	{ 0x306E, 0x9000 },	// DATAPATH_SELECT, reset default
+};
+
+static const struct ar0130_reg ar0130_640x480_binned_regs[] = {
+	{ 0x3032, 0x0002 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x03C1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x03DE },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0001 },	// X_ODD_INC
+	{ 0x30A6, 0x0001 },	// Y_ODD_INC
+	{ 0x306E, 0x9010 },	// DATAPATH_SELECT
+};
+
+static const struct ar0130_reg ar0130_640x360_binned_regs[] = {
+	{ 0x3032, 0x0002 },	// DIGITAL_BINNING
+	{ 0x3002, 0x0002 },	// Y_ADDR_START
+	{ 0x3004, 0x0000 },	// X_ADDR_START
+	{ 0x3006, 0x02D1 },	// Y_ADDR_END
+	{ 0x3008, 0x04FF },	// X_ADDR_END
+	{ 0x300A, 0x03DE },	// FRAME_LENGTH_LINES
+	{ 0x300C, 0x0672 },	// LINE_LENGTH_PCK
+	{ 0x30A2, 0x0001 },	// X_ODD_INC
+	{ 0x30A6, 0x0001 },	// Y_ODD_INC
+	{ 0x306E, 0x9010 },	// DATAPATH_SELECT
+};
@@ -511,12 +511,19 @@ static struct isp_v4l2_subdevs_group beagle_camera_subdevs[] = {
 };
 #endif //mt9v032
 
+/*
+ * Camera bus clock in kHz. The adapter can't be re-clocked once the
+ * sensor sits on it, so there is no fallback; 400 is opt-in.
+ */
+#define BEAGLE_CAM_I2C_SPEED   100
+
 //AR0130 Support
 #ifdef CONFIG_VIDEO_AR0130
 #define AR0130_RESET_GPIO      98
 #define AR0130_XCLK            ISP_XCLK_A
 #define AR0130_EXT_FREQ        27000000
-
+#define AR0130_TARGET_FREQ     74250000	/* sensor maximum pixel clock */
+#define AR0130_ISP_MAX_FREQ    75000000	/* ISP parallel interface limit */
 static int beagle_cam_set_xclk(struct v4l2_subdev *subdev, int hz)
 {
         struct isp_device *isp = v4l2_dev_to_isp_device(subdev->v4l2_dev);
@@ -532,12 +539,35 @@ static int beagle_cam_reset(struct v4l2_subdev *subdev, int active)
         return 0;
 }
 
+static int beagle_cam_set_bus_format(struct v4l2_subdev *subdev, unsigned int bpp)
+{
+        struct isp_v4l2_subdevs_group *group = v4l2_get_subdev_hostdata(subdev);
+        struct isp_parallel_platform_data *bus;
+
+        /* Set by the ISP when it registers the sensor */
+        if (group == NULL)
+                return -ENODEV;
+
+        bus = &group->bus.parallel;
+
+        /* The AR0130 drives DATA[11:0], narrower pixels are the MSBs */
+        bus->data_lane_shift = (12 - bpp) / 2;
+        /* Pack two 8-bit pixels per 16-bit word in memory */
+        bus->bridge = bpp == 8 ? ISPCTRL_PAR_BRIDGE_LENDIAN
+                               : ISPCTRL_PAR_BRIDGE_DISABLE;
+
+        return 0;
+}
+
 static struct ar0130_platform_data beagle_ar0130_platform_data = {
         .set_xclk       = beagle_cam_set_xclk,
         .reset          = beagle_cam_reset,
+        .set_bus_format = beagle_cam_set_bus_format,
         .ext_freq       = AR0130_EXT_FREQ,
-        .target_freq    = 48000000,
+        .target_freq    = AR0130_TARGET_FREQ,
+        .isp_max_freq   = AR0130_ISP_MAX_FREQ,
         .version        = AR0130_COLOR_VERSION,
+        .i2c_speed      = BEAGLE_CAM_I2C_SPEED,
 };
 
 static struct i2c_board_info ar0130_camera_i2c_device = {
@@ -590,7 +620,7 @@ static int __init beagle_camera_init(void)
 	else
 		regulator_enable(reg_2v8);
 
-	omap_register_i2c_bus(2, 100, NULL, 0);
+	omap_register_i2c_bus(2, BEAGLE_CAM_I2C_SPEED, NULL, 0);
 #ifdef CONFIG_VIDEO_MT9P031
 	gpio_request(MT9P031_RESET_GPIO, "cam_rst");
 	gpio_direction_output(MT9P031_RESET_GPIO, 0);